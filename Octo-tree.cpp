@@ -1,6 +1,30 @@
 ﻿#include <iostream>
 #include <vector>
 #include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <type_traits>
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define OCTREE_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
 #include <SFML/Window.hpp>
 #include <SFML/OpenGL.hpp>
 
@@ -14,95 +38,3257 @@ struct Point3D {
     Point3D(float x, float y, float z) : x(x), y(y), z(z) {}
 };
 
+static_assert(sizeof(Point3D) == 16, "Point3D is scanned in bulk by leaf queries and must stay 16 bytes");
+
+// Дескриптор точки в отслеживаемом дереве - индекс в таблице OctreeConfig::leafOf
+using PointHandle = uint32_t;
+
+const PointHandle kInvalidPointHandle = 0xffffffffu;
+
+// Служебные данные записи точки, нужные не каждому дереву. Они хранятся не в Point3D,
+// а в таблице меток листа (OctreeNode::tags), которая создаётся только по необходимости
+struct PointTag {
+    uint32_t multiplicity = 1;            // Число совпадающих точек, слитых в эту запись
+    PointHandle id = kInvalidPointHandle; // Дескриптор точки в отслеживаемом дереве
+};
+
+// Квадрат расстояния от точки (sx, sy, sz) до параллелепипеда с центром (x, y, z)
+// и половинами размеров (hx, hy, hz); 0, если точка внутри
+float boxDistanceSquared(float x, float y, float z, float hx, float hy, float hz, float sx, float sy, float sz) {
+    float dx = std::max(x - hx, std::min(sx, x + hx)) - sx;
+    float dy = std::max(y - hy, std::min(sy, y + hy)) - sy;
+    float dz = std::max(z - hz, std::min(sz, z + hz)) - sz;
+    return dx * dx + dy * dy + dz * dz;
+}
+
+// Проверяет, пересекается ли параллелепипед с центром (x, y, z) и половинами
+// размеров (hx, hy, hz) со сферой
+bool boxIntersectsSphere(float x, float y, float z, float hx, float hy, float hz, float sx, float sy, float sz, float sr) {
+    return boxDistanceSquared(x, y, z, hx, hy, hz, sx, sy, sz) <= (sr * sr);
+}
+
+// Проверяет, пересекается ли куб с центром (x, y, z) и ребром size со сферой
+bool cubeIntersectsSphere(float x, float y, float z, float size, float sx, float sy, float sz, float sr) {
+    return boxIntersectsSphere(x, y, z, size / 2, size / 2, size / 2, sx, sy, sz, sr);
+}
+
+// Проверяет, лежит ли параллелепипед целиком внутри сферы: самый дальний от
+// центра сферы угол должен быть не дальше радиуса
+bool boxInsideSphere(float x, float y, float z, float hx, float hy, float hz, float sx, float sy, float sz, float sr) {
+    float dx = std::fabs(x - sx) + hx;
+    float dy = std::fabs(y - sy) + hy;
+    float dz = std::fabs(z - sz) + hz;
+    return (dx * dx + dy * dy + dz * dz) <= (sr * sr);
+}
+
 // Структура для узлов Octo-tree
 struct OctreeNode {
     float x, y, z;          // Центр узла
     float size;             // Размер куба (длина ребра)
     std::vector<Point3D> points; // Точки, находящиеся внутри данного узла
+    std::unique_ptr<std::vector<PointTag>> tags; // Метки точек листа (параллельно points), если они нужны
     OctreeNode* children[8]; // Дочерние узлы
+    OctreeNode* parent = nullptr; // Родительский узел (nullptr у корня)
+    uint32_t first = 0;      // Начало точек поддерева в PointStore (после packPoints)
+    uint32_t count = 0;      // Число точек поддерева в PointStore (у листа - его собственные)
+
+    OctreeNode(float x, float y, float z, float size) : x(x), y(y), z(z), size(size) {
+        for (int i = 0; i < 8; ++i) {
+            children[i] = nullptr;
+        }
+    }
+
+    // Проверяет, содержится ли точка внутри текущего узла
+    bool containsPoint(const Point3D& point) const {
+        return (point.x >= x - size / 2 && point.x <= x + size / 2 &&
+            point.y >= y - size / 2 && point.y <= y + size / 2 &&
+            point.z >= z - size / 2 && point.z <= z + size / 2);
+    }
+
+    // Проверяет, пересекается ли узел со сферой
+    bool intersectsSphere(float sx, float sy, float sz, float sr) const {
+        return cubeIntersectsSphere(x, y, z, size, sx, sy, sz, sr);
+    }
+
+    // Проверяет, пересекается ли узел с параллелепипедом [min, max]
+    bool intersectsBox(float minX, float minY, float minZ, float maxX, float maxY, float maxZ) const {
+        float half = size / 2;
+        return x - half <= maxX && x + half >= minX && y - half <= maxY && y + half >= minY &&
+            z - half <= maxZ && z + half >= minZ;
+    }
+
+    // Проверяет, лежит ли узел целиком внутри параллелепипеда [min, max]
+    bool insideBox(float minX, float minY, float minZ, float maxX, float maxY, float maxZ) const {
+        float half = size / 2;
+        return x - half >= minX && x + half <= maxX && y - half >= minY && y + half <= maxY &&
+            z - half >= minZ && z + half <= maxZ;
+    }
+
+    // Квадрат расстояния от точки до куба узла (0, если точка внутри)
+    float distanceSquaredTo(float px, float py, float pz) const {
+        return boxDistanceSquared(x, y, z, size / 2, size / 2, size / 2, px, py, pz);
+    }
+
+    // Проверяет, лежит ли узел целиком внутри сферы
+    bool insideSphere(float sx, float sy, float sz, float sr) const {
+        return boxInsideSphere(x, y, z, size / 2, size / 2, size / 2, sx, sy, sz, sr);
+    }
+};
+
+// Подгружает в кэш память узла, который будет обработан следующим
+inline void prefetchNode(const void* address) {
+#if defined(_MSC_VER) && defined(OCTREE_X86)
+    _mm_prefetch(static_cast<const char*>(address), _MM_HINT_T0);
+#elif defined(__GNUC__)
+    __builtin_prefetch(address);
+#endif
+}
+
+// Стек для обхода дерева без рекурсии. Первые Capacity элементов лежат в массиве
+// фиксированного размера (память не инициализируется заранее); в кучу стек
+// продолжается только на вырожденно глубоких деревьях
+template <class T, size_t Capacity = 7 * 32 + 8>
+class TraversalStack {
+public:
+    TraversalStack() = default;
+    TraversalStack(const TraversalStack&) = delete;
+    TraversalStack& operator=(const TraversalStack&) = delete;
+    ~TraversalStack() {
+        for (size_t i = std::min(top, Capacity); i > 0; --i) slot(i - 1)->~T();
+    }
+
+    bool empty() const { return top == 0; }
+
+    void push(const T& value) {
+        if (top < Capacity) new (slot(top)) T(value);
+        else overflow.push_back(value);
+        ++top;
+    }
+
+    T pop() {
+        --top;
+        if (top < Capacity) {
+            T value = std::move(*slot(top));
+            slot(top)->~T();
+            return value;
+        }
+        T value = std::move(overflow.back());
+        overflow.pop_back();
+        return value;
+    }
+
+private:
+    T* slot(size_t index) { return reinterpret_cast<T*>(&items[index]); }
+
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type items[Capacity];
+    size_t top = 0;
+    std::vector<T> overflow;
+};
+
+// Пул (арена) узлов Octo-tree. Узлы выделяются сдвигом указателя внутри больших
+// блоков, а 8 дочерних узлов одного родителя всегда лежат подряд. Узлы удалённых
+// поддеревьев возвращаются через recycle() и выдаются повторно; reset() разом
+// уничтожает все узлы и оставляет блоки для следующего построения, release()
+// возвращает блоки системе
+class OctreeArena {
+public:
+    explicit OctreeArena(size_t nodesPerChunk = 8 * 512) : nodesPerChunk(std::max<size_t>(8, nodesPerChunk)) {}
+    ~OctreeArena() { release(); }
+
+    OctreeArena(const OctreeArena&) = delete;
+    OctreeArena& operator=(const OctreeArena&) = delete;
+
+    // Выделяет count (не больше nodesPerChunk) подряд идущих узлов нулевого размера.
+    // Безопасно вызывать из нескольких потоков
+    OctreeNode* allocate(size_t count) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<OctreeNode*>& freeList = (count == 8) ? freeGroups : freeNodes;
+        if ((count == 8 || count == 1) && !freeList.empty()) {
+            OctreeNode* block = freeList.back();
+            freeList.pop_back();
+            nodesInUse += count;
+            return block;
+        }
+
+        if (chunks.empty() || chunkUsed[current] + count > nodesPerChunk) {
+            if (!chunks.empty()) ++current;
+            if (current == chunks.size()) {
+                chunks.push_back(static_cast<OctreeNode*>(::operator new(nodesPerChunk * sizeof(OctreeNode))));
+                chunkUsed.push_back(0);
+            }
+        }
+        OctreeNode* block = chunks[current] + chunkUsed[current];
+        for (size_t i = 0; i < count; ++i) {
+            new (block + i) OctreeNode(0, 0, 0, 0);
+        }
+        chunkUsed[current] += count;
+        nodesInUse += count;
+        return block;
+    }
+
+    // Возвращает count узлов, начиная с block, для повторного выделения. Группа из 8
+    // подряд идущих узлов выдаётся снова целиком, остальные узлы - по одному
+    void recycle(OctreeNode* block, size_t count) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t i = 0; i < count; ++i) {
+            block[i].~OctreeNode();
+            new (block + i) OctreeNode(0, 0, 0, 0);
+            if (count != 8) freeNodes.push_back(block + i);
+        }
+        if (count == 8) freeGroups.push_back(block);
+        nodesInUse -= count;
+    }
+
+    // Уничтожает все узлы; блоки памяти остаются для повторного использования
+    void reset() {
+        std::lock_guard<std::mutex> lock(mutex);
+        freeGroups.clear();
+        freeNodes.clear();
+        for (size_t c = 0; c < chunks.size(); ++c) {
+            for (size_t i = 0; i < chunkUsed[c]; ++i) {
+                chunks[c][i].~OctreeNode();
+            }
+            chunkUsed[c] = 0;
+        }
+        current = 0;
+        nodesInUse = 0;
+    }
+
+    // Уничтожает все узлы и освобождает блоки памяти
+    void release() {
+        reset();
+        std::lock_guard<std::mutex> lock(mutex);
+        for (OctreeNode* chunk : chunks) {
+            ::operator delete(chunk);
+        }
+        chunks.clear();
+        chunkUsed.clear();
+    }
+
+    size_t nodeCount() const { return nodesInUse; }
+    size_t bytesReserved() const { return chunks.size() * nodesPerChunk * sizeof(OctreeNode); }
+    size_t bytesInUse() const { return nodesInUse * sizeof(OctreeNode); }
+
+private:
+    size_t nodesPerChunk;
+    std::vector<OctreeNode*> chunks;
+    std::vector<size_t> chunkUsed;   // Число занятых узлов в каждом блоке
+    size_t current = 0;              // Блок, из которого идёт выделение
+    size_t nodesInUse = 0;
+    std::vector<OctreeNode*> freeGroups; // Возвращённые группы по 8 узлов
+    std::vector<OctreeNode*> freeNodes;  // Возвращённые одиночные узлы
+    std::mutex mutex;
+};
+
+// Создаёт корневой узел: из арены, если она задана, иначе в куче
+OctreeNode* createRoot(float x, float y, float z, float size, OctreeArena* arena = nullptr) {
+    if (!arena) return new OctreeNode(x, y, z, size);
+    OctreeNode* root = arena->allocate(1);
+    root->x = x;
+    root->y = y;
+    root->z = z;
+    root->size = size;
+    return root;
+}
+
+// Разделяет узел на 8 дочерних узлов; при заданной арене они лежат в ней подряд
+void splitNode(OctreeNode* node, OctreeArena* arena) {
+    float half = node->size / 2;
+    float quarter = half / 2;
+    OctreeNode* block = arena ? arena->allocate(8) : nullptr;
+    for (int i = 0; i < 8; ++i) {
+        float offsetX = (i & 1) ? quarter : -quarter;
+        float offsetY = (i & 2) ? quarter : -quarter;
+        float offsetZ = (i & 4) ? quarter : -quarter;
+        if (block) {
+            node->children[i] = block + i;
+            node->children[i]->x = node->x + offsetX;
+            node->children[i]->y = node->y + offsetY;
+            node->children[i]->z = node->z + offsetZ;
+            node->children[i]->size = half;
+        }
+        else {
+            node->children[i] = new OctreeNode(node->x + offsetX, node->y + offsetY, node->z + offsetZ, half);
+        }
+        node->children[i]->parent = node;
+    }
+}
+
+// Способ распределения точек по дочерним узлам при вставке
+enum class ChildRouting {
+    AllChildren, // Точка предлагается всем 8 детям; точка на плоскости деления попадает в несколько листов
+    Owner        // Октант вычисляется сравнением с центром; границы полуоткрыты, точка хранится один раз
+};
+
+// Параметры Octo-tree, общие для вставки и пакетного построения. Пакетные
+// построители всегда распределяют точки по владельцу-октанту и не сливают совпадения
+struct OctreeConfig {
+    int maxPoints = 4;                               // Вместимость листа
+    ChildRouting routing = ChildRouting::AllChildren;
+    OctreeArena* arena = nullptr;                    // Арена для новых узлов (nullptr - куча)
+    int maxDepth = 21;                               // Глубже листы не делятся, а растут сверх maxPoints
+    bool mergeDuplicates = false;                    // Сливать совпадающие точки в одну запись (PointTag::multiplicity)
+    std::vector<OctreeNode*>* leafOf = nullptr;      // Таблица "дескриптор точки -> лист" (PointTag::id)
+};
+
+// Возвращает номер октанта, которому принадлежит точка, за три сравнения с центром узла.
+// Точка на плоскости деления относится к верхнему октанту, как и в ключах Мортона
+int childIndexFor(const OctreeNode* node, const Point3D& point) {
+    return (point.x >= node->x ? 1 : 0) | (point.y >= node->y ? 2 : 0) | (point.z >= node->z ? 4 : 0);
+}
+
+// Нужны ли дереву с такими параметрами метки точек
+bool tracksPointTags(const OctreeConfig& config) {
+    return config.mergeDuplicates || config.leafOf;
+}
+
+// Запоминает в таблице leafOf лист, в котором лежит точка с меткой tag
+void recordLeaf(const OctreeConfig& config, const PointTag& tag, OctreeNode* leaf) {
+    if (config.leafOf && tag.id != kInvalidPointHandle) (*config.leafOf)[tag.id] = leaf;
+}
+
+// Таблица меток листа; при первом обращении создаётся с метками по умолчанию
+// для уже хранящихся точек
+std::vector<PointTag>& tagsOf(OctreeNode* leaf) {
+    if (!leaf->tags) leaf->tags.reset(new std::vector<PointTag>(leaf->points.size()));
+    return *leaf->tags;
+}
+
+// Метка точки i листа (метка по умолчанию, если таблицы нет)
+PointTag pointTag(const OctreeNode* leaf, size_t i) {
+    return leaf->tags ? (*leaf->tags)[i] : PointTag();
+}
+
+// Добавляет точку в лист; метка сохраняется, только если её требует config
+void appendPoint(OctreeNode* leaf, const Point3D& point, const PointTag& tag, const OctreeConfig& config) {
+    if (tracksPointTags(config)) tagsOf(leaf).push_back(tag);
+    leaf->points.push_back(point);
+    recordLeaf(config, tag, leaf);
+}
+
+// Удаляет точку i из листа, перенося на её место последнюю
+void removePointAt(OctreeNode* leaf, size_t i) {
+    leaf->points[i] = leaf->points.back();
+    leaf->points.pop_back();
+    if (leaf->tags) {
+        (*leaf->tags)[i] = leaf->tags->back();
+        leaf->tags->pop_back();
+    }
+}
+
+// Отложенная вставка точки point с меткой tag в узел node на глубине depth
+struct InsertTask {
+    OctreeNode* node = nullptr;
+    int depth = 0;
+    Point3D point = Point3D(0, 0, 0);
+    PointTag tag;
+};
+
+// Функция для вставки точки с меткой в Octo-tree; depth - глубина узла node. Обход
+// идёт по явному стеку: в него попадают только дочерние узлы, содержащие точку
+void insertTaggedPoint(OctreeNode* node, const Point3D& point, const PointTag& tag, const OctreeConfig& config,
+    int depth = 0) {
+    if (!node->containsPoint(point)) return;
+
+    TraversalStack<InsertTask, 64> stack;
+    InsertTask task;
+    task.node = node;
+    task.depth = depth;
+    task.point = point;
+    task.tag = tag;
+    stack.push(task);
+
+    // Кладёт в стек задачи вставки p во владельца-октанта или во все дочерние
+    // узлы, содержащие p. Дети кладутся в обратном порядке, чтобы обход шёл как при рекурсии
+    auto pushChildren = [&](OctreeNode* parent, int parentDepth, const Point3D& p, const PointTag& t) {
+        InsertTask child;
+        child.depth = parentDepth + 1;
+        child.point = p;
+        child.tag = t;
+        if (config.routing == ChildRouting::Owner) {
+            child.node = parent->children[childIndexFor(parent, p)];
+            prefetchNode(child.node);
+            stack.push(child);
+            return;
+        }
+        for (int i = 7; i >= 0; --i) {
+            if (!parent->children[i]->containsPoint(p)) continue;
+            child.node = parent->children[i];
+            prefetchNode(child.node);
+            stack.push(child);
+        }
+    };
+
+    while (!stack.empty()) {
+        InsertTask current = stack.pop();
+        OctreeNode* target = current.node;
+        int targetDepth = current.depth;
+        const Point3D& p = current.point;
+        const PointTag& t = current.tag;
+
+        // Спускаемся без стека, пока точка попадает в единственный дочерний узел;
+        // остальные подходящие дочерние узлы откладываются
+        while (target->children[0] != nullptr) {
+            OctreeNode* next = nullptr;
+            if (config.routing == ChildRouting::Owner) {
+                next = target->children[childIndexFor(target, p)];
+            }
+            else {
+                for (int i = 7; i >= 0; --i) {
+                    if (!target->children[i]->containsPoint(p)) continue;
+                    if (next) {
+                        InsertTask sibling;
+                        sibling.node = next;
+                        sibling.depth = targetDepth + 1;
+                        sibling.point = p;
+                        sibling.tag = t;
+                        stack.push(sibling);
+                    }
+                    next = target->children[i];
+                }
+            }
+            prefetchNode(next);
+            target = next;
+            ++targetDepth;
+        }
+
+        // Совпадающая точка только увеличивает счётчик уже сохранённой записи,
+        // поэтому одинаковые точки не заставляют делить лист
+        if (config.mergeDuplicates) {
+            bool merged = false;
+            for (size_t i = 0; i < target->points.size(); ++i) {
+                const Point3D& stored = target->points[i];
+                if (stored.x == p.x && stored.y == p.y && stored.z == p.z) {
+                    tagsOf(target)[i].multiplicity += t.multiplicity;
+                    merged = true;
+                    break;
+                }
+            }
+            if (merged) continue;
+        }
+
+        // Если в листе меньше точек, чем maxPoints, или достигнута максимальная
+        // глубина (лист становится корзиной переполнения), добавляем точку
+        if (target->points.size() < (size_t)config.maxPoints || targetDepth >= config.maxDepth) {
+            appendPoint(target, p, t, config);
+            continue;
+        }
+
+        // Если узел переполнен, разделяем его на 8 дочерних узлов. Новая точка
+        // кладётся в стек первой, а существующие - поверх в обратном порядке,
+        // чтобы каждый дочерний узел получил их в исходной последовательности
+        splitNode(target, config.arena);
+        pushChildren(target, targetDepth, p, t);
+        for (size_t i = target->points.size(); i-- > 0;) {
+            pushChildren(target, targetDepth, target->points[i], pointTag(target, i));
+        }
+        target->points.clear();
+        target->tags.reset();
+    }
+}
+
+// Функция для вставки точки в Octo-tree; depth - глубина узла node
+void insertPoint(OctreeNode* node, const Point3D& point, const OctreeConfig& config, int depth = 0) {
+    insertTaggedPoint(node, point, PointTag(), config, depth);
+}
+
+// Вставка точки с заданной вместимостью листа. Новые узлы берутся из arena, если она задана
+void insertPoint(OctreeNode* node, const Point3D& point, int maxPoints = 4, OctreeArena* arena = nullptr) {
+    OctreeConfig config;
+    config.maxPoints = maxPoints;
+    config.arena = arena;
+    insertPoint(node, point, config);
+}
+
+// Освобождает все дочерние узлы (вместе с потомками): возвращает их в арену,
+// если она задана, иначе удаляет из кучи
+void freeChildren(OctreeNode* node, OctreeArena* arena) {
+    if (node->children[0] == nullptr) return;
+    for (int i = 0; i < 8; ++i) {
+        freeChildren(node->children[i], arena);
+    }
+
+    bool contiguous = true;
+    for (int i = 1; i < 8; ++i) {
+        contiguous = contiguous && node->children[i] == node->children[0] + i;
+    }
+    if (arena && contiguous) {
+        arena->recycle(node->children[0], 8);
+    }
+    for (int i = 0; i < 8; ++i) {
+        if (!arena) delete node->children[i];
+        else if (!contiguous) arena->recycle(node->children[i], 1);
+        node->children[i] = nullptr;
+    }
+}
+
+// Считает записи точек в поддереве, прекращая подсчёт после limit
+size_t countPointsUpTo(const OctreeNode* node, size_t limit) {
+    size_t total = node->points.size();
+    if (node->children[0] == nullptr) return total;
+    for (int i = 0; i < 8 && total < limit; ++i) {
+        total += countPointsUpTo(node->children[i], limit - total);
+    }
+    return total;
+}
+
+// Собирает точки поддерева и их метки, беря каждую точку только из её
+// октанта-владельца, чтобы копии граничных точек (при ChildRouting::AllChildren) не повторялись
+void gatherOwnedPoints(const OctreeNode* node, std::vector<Point3D>& out, std::vector<PointTag>& outTags) {
+    if (node->children[0] == nullptr) {
+        out.insert(out.end(), node->points.begin(), node->points.end());
+        for (size_t i = 0; i < node->points.size(); ++i) {
+            outTags.push_back(pointTag(node, i));
+        }
+        return;
+    }
+    std::vector<Point3D> childPoints;
+    std::vector<PointTag> childTags;
+    for (int i = 0; i < 8; ++i) {
+        childPoints.clear();
+        childTags.clear();
+        gatherOwnedPoints(node->children[i], childPoints, childTags);
+        for (size_t k = 0; k < childPoints.size(); ++k) {
+            if (childIndexFor(node, childPoints[k]) != i) continue;
+            out.push_back(childPoints[k]);
+            outTags.push_back(childTags[k]);
+        }
+    }
+}
+
+// Если в поддереве узла меньше maxPoints точек, сливает дочерние узлы обратно
+// в узел и освобождает их. Возвращает true, если узел был слит
+bool collapseIfSparse(OctreeNode* node, const OctreeConfig& config) {
+    if (node->children[0] == nullptr) return false;
+    if (countPointsUpTo(node, config.maxPoints) >= (size_t)config.maxPoints) return false;
+
+    std::vector<PointTag> tags;
+    gatherOwnedPoints(node, node->points, tags);
+    freeChildren(node, config.arena);
+    if (tracksPointTags(config)) {
+        for (const auto& tag : tags) {
+            recordLeaf(config, tag, node);
+        }
+        node->tags.reset(new std::vector<PointTag>(std::move(tags)));
+    }
+    return true;
+}
+
+// Функция для удаления точки из Octo-tree по значению. Удаляет одно вхождение
+// (у слитой записи уменьшает multiplicity). Если в поддереве узла остаётся меньше
+// maxPoints точек, его дочерние узлы сливаются обратно в узел и освобождаются
+bool erasePoint(OctreeNode* node, const Point3D& point, const OctreeConfig& config) {
+    if (!node || !node->containsPoint(point)) return false;
+
+    if (node->children[0] == nullptr) {
+        for (size_t i = 0; i < node->points.size(); ++i) {
+            const Point3D& p = node->points[i];
+            if (p.x != point.x || p.y != point.y || p.z != point.z) continue;
+            if (pointTag(node, i).multiplicity > 1) {
+                --(*node->tags)[i].multiplicity;
+            }
+            else {
+                recordLeaf(config, pointTag(node, i), nullptr);
+                removePointAt(node, i);
+            }
+            return true;
+        }
+        return false;
+    }
+
+    bool erased = false;
+    if (config.routing == ChildRouting::Owner) {
+        erased = erasePoint(node->children[childIndexFor(node, point)], point, config);
+    }
+    else {
+        // Копии граничной точки лежат в нескольких листах - удаляем из каждого
+        for (int i = 0; i < 8; ++i) {
+            erased = erasePoint(node->children[i], point, config) || erased;
+        }
+    }
+
+    if (erased) collapseIfSparse(node, config);
+    return erased;
+}
+
+// Собирает из поддерева старого корня точки, лежащие на его верхних гранях, которые
+// стали плоскостями деления нового корня parent: по childIndexFor они принадлежат
+// соседнему октанту. При ChildRouting::Owner точки удаляются из своих листов
+void collectFacePoints(OctreeNode* node, const OctreeNode* parent, int oldIndex, const OctreeConfig& config,
+    std::vector<std::pair<Point3D, PointTag>>& out) {
+    // Узел, не касающийся ни одной из этих граней, пропускается целиком
+    float half = node->size / 2;
+    bool touches = (!(oldIndex & 1) && node->x + half >= parent->x) ||
+        (!(oldIndex & 2) && node->y + half >= parent->y) ||
+        (!(oldIndex & 4) && node->z + half >= parent->z);
+    if (!touches) return;
+
+    if (node->children[0] != nullptr) {
+        for (int i = 0; i < 8; ++i) {
+            collectFacePoints(node->children[i], parent, oldIndex, config, out);
+        }
+        return;
+    }
+    for (size_t i = node->points.size(); i-- > 0;) {
+        if (childIndexFor(parent, node->points[i]) == oldIndex) continue;
+        out.emplace_back(node->points[i], pointTag(node, i));
+        if (config.routing == ChildRouting::Owner) removePointAt(node, i);
+    }
+}
+
+// Оборачивает корень в родительский куб вдвое большего размера, расширяясь в сторону
+// точки. Старый корень становится одним из 8 дочерних узлов без перестройки поддерева;
+// перераспределяются только точки на его гранях, ставших плоскостями деления
+OctreeNode* growRoot(OctreeNode* root, const Point3D& point, const OctreeConfig& config) {
+    float half = root->size / 2;
+    int oldIndex = 0;
+    float px = root->x + half, py = root->y + half, pz = root->z + half;
+    if (point.x < root->x - half) { px = root->x - half; oldIndex |= 1; }
+    if (point.y < root->y - half) { py = root->y - half; oldIndex |= 2; }
+    if (point.z < root->z - half) { pz = root->z - half; oldIndex |= 4; }
+
+    OctreeArena* arena = config.arena;
+    OctreeNode* parent = createRoot(px, py, pz, root->size * 2, arena);
+    OctreeNode* siblings = arena ? arena->allocate(7) : nullptr;
+    for (int i = 0; i < 8; ++i) {
+        if (i == oldIndex) {
+            parent->children[i] = root;
+            root->parent = parent;
+            continue;
+        }
+        float offsetX = (i & 1) ? half : -half;
+        float offsetY = (i & 2) ? half : -half;
+        float offsetZ = (i & 4) ? half : -half;
+        if (siblings) {
+            OctreeNode* sibling = siblings++;
+            sibling->x = px + offsetX;
+            sibling->y = py + offsetY;
+            sibling->z = pz + offsetZ;
+            sibling->size = root->size;
+            parent->children[i] = sibling;
+        }
+        else {
+            parent->children[i] = new OctreeNode(px + offsetX, py + offsetY, pz + offsetZ, root->size);
+        }
+        parent->children[i]->parent = parent;
+    }
+
+    // Точки на новых плоскостях деления переходят к владельцу-октанту; при
+    // ChildRouting::AllChildren их копии добавляются во все содержащие их октанты
+    std::vector<std::pair<Point3D, PointTag>> facePoints;
+    collectFacePoints(root, parent, oldIndex, config, facePoints);
+    for (const auto& entry : facePoints) {
+        if (config.routing == ChildRouting::Owner) {
+            insertTaggedPoint(parent->children[childIndexFor(parent, entry.first)], entry.first, entry.second, config, 1);
+            continue;
+        }
+        for (int i = 0; i < 8; ++i) {
+            if (i == oldIndex || !parent->children[i]->containsPoint(entry.first)) continue;
+            insertTaggedPoint(parent->children[i], entry.first, entry.second, config, 1);
+        }
+    }
+    return parent;
+}
+
+// Функция для вставки точки с расширением корня: пока точка не помещается в корень,
+// он удваивается в её сторону, поэтому точки вне исходного куба не теряются
+void insertPointGrowing(OctreeNode*& root, const Point3D& point, const OctreeConfig& config) {
+    if (!std::isfinite(point.x) || !std::isfinite(point.y) || !std::isfinite(point.z)) return;
+    while (!root->containsPoint(point)) {
+        root = growRoot(root, point, config);
+    }
+    insertPoint(root, point, config);
+}
+
+// Перемещение точки с дескриптором handle в позицию (x, y, z)
+struct PointMove {
+    PointHandle handle;
+    float x, y, z;
+};
+
+// Поддерживает ли дерево с такими параметрами дескрипторы точек: нужна таблица
+// leafOf, ChildRouting::Owner (каждая точка хранится в одном листе) и отключённое
+// слияние совпадающих точек. При других параметрах функции дескрипторов ничего не делают
+bool supportsPointHandles(const OctreeConfig& config) {
+    return config.leafOf && config.routing == ChildRouting::Owner && !config.mergeDuplicates;
+}
+
+// Проверяет, принадлежит ли точка ячейке узла по правилу владения: верхние грани
+// ячейки открыты (точка на них принадлежит соседу), у корня - закрыты
+bool ownsPoint(const OctreeNode* node, const Point3D& point) {
+    if (!node->parent) return node->containsPoint(point);
+    float half = node->size / 2;
+    return point.x >= node->x - half && point.x < node->x + half &&
+        point.y >= node->y - half && point.y < node->y + half &&
+        point.z >= node->z - half && point.z < node->z + half;
+}
+
+// Возвращает глубину узла (0 у корня)
+int nodeDepth(const OctreeNode* node) {
+    int depth = 0;
+    for (; node->parent; node = node->parent) {
+        ++depth;
+    }
+    return depth;
+}
+
+// Проверяет, что ссылка parent каждого узла поддерева указывает на его настоящего родителя
+bool parentLinksValid(const OctreeNode* node) {
+    if (!node || node->children[0] == nullptr) return true;
+    for (int i = 0; i < 8; ++i) {
+        if (node->children[i]->parent != node || !parentLinksValid(node->children[i])) return false;
+    }
+    return true;
+}
+
+// Заново заносит в таблицу leafOf листы всех точек дерева по их меткам
+void indexPointHandles(OctreeNode* node, std::vector<OctreeNode*>& leafOf) {
+    if (!node) return;
+    for (size_t i = 0; i < node->points.size(); ++i) {
+        PointHandle id = pointTag(node, i).id;
+        if (id == kInvalidPointHandle) continue;
+        if (id >= leafOf.size()) leafOf.resize(id + 1, nullptr);
+        leafOf[id] = node;
+    }
+    for (int i = 0; i < 8; ++i) {
+        indexPointHandles(node->children[i], leafOf);
+    }
+}
+
+// Функция для вставки точки в отслеживаемое дерево. Назначает точке новый
+// дескриптор и возвращает его (kInvalidPointHandle, если точка вне корня или
+// параметры дерева не поддерживают дескрипторы)
+PointHandle insertPointTracked(OctreeNode* root, const Point3D& point, const OctreeConfig& config) {
+    if (!supportsPointHandles(config)) return kInvalidPointHandle;
+    std::vector<OctreeNode*>& leafOf = *config.leafOf;
+    PointTag tag;
+    tag.id = (PointHandle)leafOf.size();
+    leafOf.push_back(nullptr);
+    insertTaggedPoint(root, point, tag, config);
+    if (leafOf.back()) return tag.id;
+    leafOf.pop_back();
+    return kInvalidPointHandle;
+}
+
+// Поднимается от узла к корню, сливая узлы, поддеревья которых стали разреженными
+void collapseUpward(OctreeNode* node, const OctreeConfig& config) {
+    for (; node && collapseIfSparse(node, config); node = node->parent) {}
+}
+
+// Функция для удаления точки из отслеживаемого дерева по дескриптору
+bool erasePoint(PointHandle handle, const OctreeConfig& config) {
+    if (!supportsPointHandles(config)) return false;
+    std::vector<OctreeNode*>& leafOf = *config.leafOf;
+    if (handle >= leafOf.size() || !leafOf[handle]) return false;
+
+    OctreeNode* leaf = leafOf[handle];
+    for (size_t i = 0; i < leaf->points.size(); ++i) {
+        if (pointTag(leaf, i).id != handle) continue;
+        removePointAt(leaf, i);
+        leafOf[handle] = nullptr;
+        collapseUpward(leaf->parent, config);
+        return true;
+    }
+    return false;
+}
+
+// Точка, покидающая свой лист при перемещении: новая и прежняя позиции
+struct LeavingPoint {
+    Point3D point;
+    Point3D from;
+    PointTag tag;
+};
+
+// Функция для пакетного перемещения точек. Перемещения группируются по текущему
+// листу: точки, оставшиеся в своём листе, обновляются на месте, остальные
+// поднимаются только до ближайшего предка, которому принадлежит новая позиция,
+// и спускаются от него. Поэтому стоимость зависит от дальности перемещения,
+// а не от глубины дерева. Перемещение за пределы корня не выполняется: точка
+// остаётся на прежнем месте. Возвращает число перемещённых точек
+size_t movePoints(std::vector<PointMove> moves, const OctreeConfig& config) {
+    if (!supportsPointHandles(config)) return 0;
+    std::vector<OctreeNode*>& leafOf = *config.leafOf;
+    auto leafFor = [&](const PointMove& m) { return m.handle < leafOf.size() ? leafOf[m.handle] : nullptr; };
+    std::sort(moves.begin(), moves.end(),
+        [&](const PointMove& a, const PointMove& b) { return std::less<OctreeNode*>()(leafFor(a), leafFor(b)); });
+
+    size_t moved = 0;
+    std::vector<LeavingPoint> leavers;
+    for (size_t begin = 0, end = 0; begin < moves.size(); begin = end) {
+        // Лист перечитывается из таблицы: предыдущие группы могли разделить или слить узлы
+        OctreeNode* leaf = leafFor(moves[begin]);
+        for (end = begin + 1; end < moves.size() && leafFor(moves[end]) == leaf; ++end) {}
+        if (!leaf) continue;
+
+        leavers.clear();
+        for (size_t m = begin; m < end; ++m) {
+            for (size_t i = 0; i < leaf->points.size(); ++i) {
+                if (pointTag(leaf, i).id != moves[m].handle) continue;
+                Point3D& p = leaf->points[i];
+                Point3D from = p;
+                p.x = moves[m].x;
+                p.y = moves[m].y;
+                p.z = moves[m].z;
+                if (!ownsPoint(leaf, p)) {
+                    leavers.push_back({ p, from, pointTag(leaf, i) });
+                    leafOf[moves[m].handle] = nullptr;
+                    removePointAt(leaf, i);
+                }
+                ++moved;
+                break;
+            }
+        }
+
+        // Глубина листа считается один раз на группу; глубина предка - по числу пройденных уровней
+        int leafDepth = leavers.empty() ? 0 : nodeDepth(leaf);
+        for (const auto& leaver : leavers) {
+            OctreeNode* top = leaf;
+            OctreeNode* target = leaf->parent;
+            int targetDepth = leafDepth - 1;
+            while (target && !ownsPoint(target, leaver.point)) {
+                top = target;
+                target = target->parent;
+                --targetDepth;
+            }
+            if (target) {
+                insertTaggedPoint(target, leaver.point, leaver.tag, config, targetDepth);
+            }
+            else {
+                // Новая позиция вне корня - возвращаем точку на прежнее место
+                insertTaggedPoint(top, leaver.from, leaver.tag, config);
+                --moved;
+            }
+        }
+        if (!leavers.empty()) collapseUpward(leaf->parent, config);
+    }
+    return moved;
+}
+
+// Функция для перемещения одной точки
+bool movePoint(PointHandle handle, float x, float y, float z, const OctreeConfig& config) {
+    return movePoints({ { handle, x, y, z } }, config) == 1;
+}
+
+// Вычисляет наименьший куб (центр и размер), содержащий все точки набора
+void computeBounds(const std::vector<Point3D>& points, float& x, float& y, float& z, float& size) {
+    if (points.empty()) {
+        x = y = z = 0;
+        size = 1;
+        return;
+    }
+
+    float minX = points[0].x, minY = points[0].y, minZ = points[0].z;
+    float maxX = minX, maxY = minY, maxZ = minZ;
+    for (const auto& point : points) {
+        minX = std::min(minX, point.x);
+        minY = std::min(minY, point.y);
+        minZ = std::min(minZ, point.z);
+        maxX = std::max(maxX, point.x);
+        maxY = std::max(maxY, point.y);
+        maxZ = std::max(maxZ, point.z);
+    }
+    x = minX + (maxX - minX) / 2;
+    y = minY + (maxY - minY) / 2;
+    z = minZ + (maxZ - minZ) / 2;
+
+    // Небольшой запас, чтобы крайние точки не терялись на округлении центра
+    size = std::max(maxX - minX, std::max(maxY - minY, maxZ - minZ));
+    size = std::max(size * 1.0001f, 1e-6f);
+}
+
+// Вставляет точки work[begin, end) в поддерево узла node на глубине depth.
+// tags - метки точек параллельно work (пустой, если дерево меток не хранит).
+// Диапазон может переупорядочиваться
+void insertBatchRange(OctreeNode* node, std::vector<Point3D>& work, std::vector<PointTag>& tags, size_t begin,
+    size_t end, const OctreeConfig& config, int depth) {
+    if (begin == end) return;
+    auto tagAt = [&](size_t i) { return tags.empty() ? PointTag() : tags[i]; };
+
+    if (node->children[0] == nullptr) {
+        // Слияние совпадений требует поиска по листу - вставляем по одной точке
+        if (config.mergeDuplicates) {
+            for (size_t i = begin; i < end; ++i) {
+                insertTaggedPoint(node, work[i], tagAt(i), config, depth);
+            }
+            return;
+        }
+
+        // Лист принимает всю группу, если она помещается в него целиком
+        size_t total = node->points.size() + (end - begin);
+        if (total <= (size_t)config.maxPoints || depth >= config.maxDepth) {
+            node->points.reserve(total);
+            for (size_t i = begin; i < end; ++i) {
+                appendPoint(node, work[i], tagAt(i), config);
+            }
+            return;
+        }
+
+        // Иначе лист делится один раз, и его точки идут вниз вместе с группой
+        std::vector<Point3D> combined;
+        std::vector<PointTag> combinedTags;
+        combined.reserve(total);
+        combined.insert(combined.end(), node->points.begin(), node->points.end());
+        combined.insert(combined.end(), work.begin() + begin, work.begin() + end);
+        if (!tags.empty()) {
+            combinedTags.reserve(total);
+            for (size_t i = 0; i < node->points.size(); ++i) {
+                combinedTags.push_back(pointTag(node, i));
+            }
+            combinedTags.insert(combinedTags.end(), tags.begin() + begin, tags.begin() + end);
+        }
+        std::vector<Point3D>().swap(node->points);
+        node->tags.reset();
+        splitNode(node, config.arena);
+        insertBatchRange(node, combined, combinedTags, 0, combined.size(), config, depth);
+        return;
+    }
+
+    if (config.routing == ChildRouting::AllChildren) {
+        // Точка на плоскости деления уходит во все содержащие её октанты
+        std::vector<Point3D> group;
+        std::vector<PointTag> groupTags;
+        for (int i = 0; i < 8; ++i) {
+            group.clear();
+            groupTags.clear();
+            for (size_t k = begin; k < end; ++k) {
+                if (!node->children[i]->containsPoint(work[k])) continue;
+                group.push_back(work[k]);
+                if (!tags.empty()) groupTags.push_back(tags[k]);
+            }
+            insertBatchRange(node->children[i], group, groupTags, 0, group.size(), config, depth + 1);
+        }
+        return;
+    }
+
+    // Стабильно раскладываем группу по октантам и спускаемся один раз в каждый
+    size_t offsets[9] = { 0 };
+    for (size_t i = begin; i < end; ++i) {
+        ++offsets[childIndexFor(node, work[i]) + 1];
+    }
+    for (int i = 0; i < 8; ++i) {
+        offsets[i + 1] += offsets[i];
+    }
+    std::vector<Point3D> sorted(work.begin() + begin, work.begin() + end);
+    std::vector<PointTag> sortedTags;
+    if (!tags.empty()) sortedTags.assign(tags.begin() + begin, tags.begin() + end);
+    size_t cursor[8];
+    std::copy(offsets, offsets + 8, cursor);
+    for (size_t k = 0; k < sorted.size(); ++k) {
+        size_t slot = begin + cursor[childIndexFor(node, sorted[k])]++;
+        work[slot] = sorted[k];
+        if (!tags.empty()) tags[slot] = sortedTags[k];
+    }
+    for (int i = 0; i < 8; ++i) {
+        insertBatchRange(node->children[i], work, tags, begin + offsets[i], begin + offsets[i + 1], config,
+            depth + 1);
+    }
+}
+
+// Функция для пакетной вставки точек. Пакет раскладывается по октантам на каждом
+// уровне, поэтому каждый узел посещается один раз за пакет, а делящийся лист
+// сразу получает все свои точки. Дерево получается таким же, как при вставке
+// точек по одной в том же порядке. В отслеживаемом дереве точка points[i]
+// получает дескриптор leafOf.size() + i (взятый до вставки); у точек вне корня
+// запись в leafOf остаётся пустой
+void insertBatch(OctreeNode* root, const Point3D* points, size_t count, const OctreeConfig& config) {
+    PointHandle firstHandle = 0;
+    if (config.leafOf) {
+        firstHandle = (PointHandle)config.leafOf->size();
+        config.leafOf->resize(config.leafOf->size() + count, nullptr);
+    }
+
+    std::vector<Point3D> work;
+    std::vector<PointTag> tags;
+    work.reserve(count);
+    if (tracksPointTags(config)) tags.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        if (!root->containsPoint(points[i])) continue;
+        work.push_back(points[i]);
+        if (!tracksPointTags(config)) continue;
+        tags.emplace_back();
+        if (config.leafOf) tags.back().id = firstHandle + (PointHandle)i;
+    }
+    insertBatchRange(root, work, tags, 0, work.size(), config, 0);
+}
+
+void insertBatch(OctreeNode* root, const std::vector<Point3D>& points, const OctreeConfig& config) {
+    insertBatch(root, points.data(), points.size(), config);
+}
+
+// Количество бит на ось в ключе Мортона (3 * 21 = 63 бита ключа)
+const int kMortonBitsPerAxis = 21;
+
+// Ключ Мортона точки и её индекс во входном массиве
+struct MortonEntry {
+    uint64_t key;
+    uint32_t index;
+};
+
+// Раздвигает младшие 21 бит числа так, чтобы между ними стояло по два нулевых бита
+uint64_t expandMortonBits(uint64_t v) {
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffULL;
+    v = (v | v << 16) & 0x1f0000ff0000ffULL;
+    v = (v | v << 8) & 0x100f00f00f00f00fULL;
+    v = (v | v << 4) & 0x10c30c30c30c30c3ULL;
+    v = (v | v << 2) & 0x1249249249249249ULL;
+    return v;
+}
+
+// Вычисляет ключ Мортона (Z-order) точки относительно куба корня.
+// Биты x, y, z чередуются так же, как индексы дочерних узлов в insertPoint
+// (бит 0 - x, бит 1 - y, бит 2 - z), поэтому старшие 3 бита ключа - номер октанта корня
+uint64_t mortonKey(const Point3D& point, float x, float y, float z, float size) {
+    const double cells = (double)(1u << kMortonBitsPerAxis);
+    auto quantize = [&](float v, float c) {
+        double t = (v - (c - size / 2.0)) / size * cells;
+        t = std::max(0.0, std::min(t, cells - 1));
+        return (uint64_t)t;
+    };
+    return expandMortonBits(quantize(point.x, x)) |
+        expandMortonBits(quantize(point.y, y)) << 1 |
+        expandMortonBits(quantize(point.z, z)) << 2;
+}
+
+// Поразрядная (LSD) сортировка ключей Мортона по 8 бит за проход
+void radixSortMorton(std::vector<MortonEntry>& entries) {
+    std::vector<MortonEntry> buffer(entries.size());
+    for (int shift = 0; shift < 3 * kMortonBitsPerAxis; shift += 8) {
+        size_t count[257] = { 0 };
+        for (const auto& e : entries) {
+            ++count[((e.key >> shift) & 0xff) + 1];
+        }
+
+        // Если все ключи попали в одну корзину, проход ничего не меняет
+        if (std::find(count + 1, count + 257, entries.size()) != count + 257) continue;
+
+        for (int i = 0; i < 256; ++i) {
+            count[i + 1] += count[i];
+        }
+        for (const auto& e : entries) {
+            buffer[count[(e.key >> shift) & 0xff]++] = e;
+        }
+        entries.swap(buffer);
+    }
+}
+
+// Записывает метки точек только что построенного листа: дескриптор точки в
+// отслеживаемом дереве - её индекс во входном массиве
+void tagBuiltLeaf(OctreeNode* leaf, const MortonEntry* entries, size_t count, const OctreeConfig& config) {
+    std::vector<PointTag>& tags = tagsOf(leaf);
+    tags.resize(count);
+    for (size_t i = 0; i < count; ++i) {
+        tags[i].id = entries[i].index;
+        recordLeaf(config, tags[i], leaf);
+    }
+}
+
+// Строит поддерево узла по отсортированному диапазону ключей [begin, end).
+// Все ключи диапазона имеют общий префикс, поэтому границы октантов находятся
+// двоичным поиском, а каждая точка копируется один раз - сразу в свой лист
+void buildMortonRange(OctreeNode* node, const std::vector<Point3D>& points, const std::vector<MortonEntry>& entries,
+    size_t begin, size_t end, int level, const OctreeConfig& config) {
+    // Как и в insertPoint, узел делится, только если точек больше maxPoints.
+    // На максимальной глубине (и на последнем уровне ключа) лист хранит все точки
+    if (end - begin <= (size_t)config.maxPoints || level >= std::min(config.maxDepth, kMortonBitsPerAxis)) {
+        node->points.reserve(end - begin);
+        for (size_t i = begin; i < end; ++i) {
+            node->points.push_back(points[entries[i].index]);
+        }
+        if (config.leafOf) tagBuiltLeaf(node, entries.data() + begin, end - begin, config);
+        return;
+    }
+
+    int shift = 3 * (kMortonBitsPerAxis - 1 - level);
+    splitNode(node, config.arena);
+    size_t childBegin = begin;
+    for (int i = 0; i < 8; ++i) {
+        size_t childEnd = std::partition_point(entries.begin() + childBegin, entries.begin() + end,
+            [&](const MortonEntry& e) { return (int)((e.key >> shift) & 7) <= i; }) - entries.begin();
+        buildMortonRange(node->children[i], points, entries, childBegin, childEnd, level + 1, config);
+        childBegin = childEnd;
+    }
+}
+
+// Функция для пакетного построения Octo-tree: вычисляет ключи Мортона всех точек,
+// сортирует их поразрядно и строит узлы за один проход по отсортированному массиву.
+// Точки вне куба корня отбрасываются, как и в insertPoint. Если задана таблица
+// leafOf, она заполняется заново: дескриптор точки - её индекс в points
+OctreeNode* buildOctreeMorton(const std::vector<Point3D>& points, float x, float y, float z, float size,
+    const OctreeConfig& config = OctreeConfig()) {
+    OctreeNode* root = createRoot(x, y, z, size, config.arena);
+    if (config.leafOf) config.leafOf->assign(points.size(), nullptr);
+
+    std::vector<MortonEntry> entries;
+    entries.reserve(points.size());
+    for (size_t i = 0; i < points.size(); ++i) {
+        if (!root->containsPoint(points[i])) continue;
+        entries.push_back({ mortonKey(points[i], x, y, z, size), (uint32_t)i });
+    }
+    radixSortMorton(entries);
+
+    buildMortonRange(root, points, entries, 0, entries.size(), 0, config);
+    return root;
+}
+
+// Рекурсивно освобождает узлы дерева, построенного без арены
+void deleteOctree(OctreeNode* node) {
+    if (!node) return;
+    for (int i = 0; i < 8; ++i) {
+        deleteOctree(node->children[i]);
+    }
+    delete node;
+}
+
+// Сравнивает два дерева: геометрию узлов, структуру и точки в листьях
+bool octreesEqual(const OctreeNode* a, const OctreeNode* b) {
+    if (!a || !b) return a == b;
+    if (a->x != b->x || a->y != b->y || a->z != b->z || a->size != b->size) return false;
+    if (a->points.size() != b->points.size()) return false;
+    for (size_t i = 0; i < a->points.size(); ++i) {
+        const Point3D& p = a->points[i];
+        const Point3D& q = b->points[i];
+        if (p.x != q.x || p.y != q.y || p.z != q.z) return false;
+    }
+    for (int i = 0; i < 8; ++i) {
+        if (!octreesEqual(a->children[i], b->children[i])) return false;
+    }
+    return true;
+}
+
+// Планировщик задач с кражей работы. У каждого потока своя очередь: поток
+// берёт новые задачи с её конца, а свободный поток крадёт самые старые (самые
+// крупные) задачи из начала чужой очереди. Вызывающий поток работает как поток 0
+class WorkStealingPool {
+public:
+    using Task = std::function<void()>;
+
+    explicit WorkStealingPool(unsigned threadCount) : queues(std::max(1u, threadCount)) {
+        for (auto& queue : queues) {
+            queue.reset(new Queue());
+        }
+        for (unsigned i = 1; i < queues.size(); ++i) {
+            threads.emplace_back([this, i] { workerLoop(i); });
+        }
+    }
+
+    ~WorkStealingPool() {
+        stop = true;
+        sleepCondition.notify_all();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    unsigned threadCount() const { return (unsigned)queues.size(); }
+
+    // Добавляет задачу в очередь текущего потока (для внешних потоков - в очередь 0)
+    void submit(Task task) {
+        unsigned self = (currentPool == this) ? currentWorker : 0;
+        ++pending;
+        {
+            std::lock_guard<std::mutex> lock(queues[self]->mutex);
+            queues[self]->tasks.push_back(std::move(task));
+        }
+        sleepCondition.notify_one();
+    }
+
+    // Выполняет задачи в вызывающем потоке, пока не будут выполнены все
+    void wait() {
+        WorkStealingPool* savedPool = currentPool;
+        unsigned savedWorker = currentWorker;
+        currentPool = this;
+        currentWorker = 0;
+        while (pending > 0) {
+            if (!runOne(0)) std::this_thread::yield();
+        }
+        currentPool = savedPool;
+        currentWorker = savedWorker;
+    }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    bool runOne(unsigned self) {
+        Task task;
+        if (!popLocal(self, task) && !steal(self, task)) return false;
+        task();
+        --pending;
+        return true;
+    }
+
+    bool popLocal(unsigned self, Task& task) {
+        std::lock_guard<std::mutex> lock(queues[self]->mutex);
+        if (queues[self]->tasks.empty()) return false;
+        task = std::move(queues[self]->tasks.back());
+        queues[self]->tasks.pop_back();
+        return true;
+    }
+
+    bool steal(unsigned self, Task& task) {
+        for (unsigned i = 1; i < queues.size(); ++i) {
+            Queue& victim = *queues[(self + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (victim.tasks.empty()) continue;
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            return true;
+        }
+        return false;
+    }
+
+    void workerLoop(unsigned self) {
+        currentPool = this;
+        currentWorker = self;
+        while (!stop) {
+            if (runOne(self)) continue;
+            // Очереди пусты - засыпаем до новой задачи (с таймаутом на случай пропущенного сигнала)
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            sleepCondition.wait_for(lock, std::chrono::milliseconds(1));
+        }
+    }
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> threads;
+    std::atomic<size_t> pending{ 0 };
+    std::atomic<bool> stop{ false };
+    std::mutex sleepMutex;
+    std::condition_variable sleepCondition;
+
+    static thread_local WorkStealingPool* currentPool;
+    static thread_local unsigned currentWorker;
+};
+
+thread_local WorkStealingPool* WorkStealingPool::currentPool = nullptr;
+thread_local unsigned WorkStealingPool::currentWorker = 0;
+
+// Минимальный диапазон точек, который выносится в отдельную задачу
+const size_t kParallelBuildGrain = 4096;
+
+// Параллельно строит поддерево узла по диапазону [begin, end) массива src,
+// упорядоченному по старшим битам ключа до уровня level. Диапазон стабильно
+// раскладывается по октантам в dst (поразрядная MSD-сортировка), после чего
+// дочерние узлы строятся по dst с переставленными буферами. Крупные октанты
+// уходят в планировщик отдельными задачами, мелкие строятся в текущем потоке
+void buildParallelRange(WorkStealingPool& pool, OctreeNode* node, const std::vector<Point3D>& points,
+    MortonEntry* src, MortonEntry* dst, size_t begin, size_t end, int level, const OctreeConfig& config) {
+    if (end - begin <= (size_t)config.maxPoints || level >= std::min(config.maxDepth, kMortonBitsPerAxis)) {
+        // Порядок точек в листе такой же, как после полной сортировки в buildOctreeMorton
+        std::stable_sort(src + begin, src + end,
+            [](const MortonEntry& a, const MortonEntry& b) { return a.key < b.key; });
+        node->points.reserve(end - begin);
+        for (size_t i = begin; i < end; ++i) {
+            node->points.push_back(points[src[i].index]);
+        }
+        if (config.leafOf) tagBuiltLeaf(node, src + begin, end - begin, config);
+        return;
+    }
+
+    int shift = 3 * (kMortonBitsPerAxis - 1 - level);
+    size_t offsets[9] = { 0 };
+    for (size_t i = begin; i < end; ++i) {
+        ++offsets[((src[i].key >> shift) & 7) + 1];
+    }
+    offsets[0] = begin;
+    for (int i = 0; i < 8; ++i) {
+        offsets[i + 1] += offsets[i];
+    }
+    size_t cursor[8];
+    std::copy(offsets, offsets + 8, cursor);
+    for (size_t i = begin; i < end; ++i) {
+        dst[cursor[(src[i].key >> shift) & 7]++] = src[i];
+    }
+
+    splitNode(node, config.arena);
+    for (int i = 0; i < 8; ++i) {
+        OctreeNode* child = node->children[i];
+        size_t childBegin = offsets[i], childEnd = offsets[i + 1];
+        if (childEnd - childBegin >= kParallelBuildGrain) {
+            pool.submit([&pool, child, &points, src, dst, childBegin, childEnd, level, &config] {
+                buildParallelRange(pool, child, points, dst, src, childBegin, childEnd, level + 1, config);
+            });
+        }
+        else {
+            buildParallelRange(pool, child, points, dst, src, childBegin, childEnd, level + 1, config);
+        }
+    }
+}
+
+// Функция для параллельного построения Octo-tree на threadCount потоках.
+// Результат совпадает с деревом buildOctreeMorton узел в узел
+OctreeNode* buildOctreeParallel(const std::vector<Point3D>& points, float x, float y, float z, float size,
+    const OctreeConfig& config = OctreeConfig(), unsigned threadCount = std::thread::hardware_concurrency()) {
+    OctreeNode* root = createRoot(x, y, z, size, config.arena);
+    if (config.leafOf) config.leafOf->assign(points.size(), nullptr);
+    WorkStealingPool pool(threadCount);
+
+    // Ключи считаются параллельно по блокам; порядок точек сохраняется
+    size_t blockCount = std::max<size_t>(1, std::min<size_t>(pool.threadCount() * 4, points.size() / kParallelBuildGrain));
+    size_t blockSize = (points.size() + blockCount - 1) / blockCount;
+    std::vector<std::vector<MortonEntry>> blocks(blockCount);
+    for (size_t b = 0; b < blockCount; ++b) {
+        pool.submit([&, b] {
+            size_t first = b * blockSize, last = std::min(points.size(), first + blockSize);
+            for (size_t i = first; i < last; ++i) {
+                if (!root->containsPoint(points[i])) continue;
+                blocks[b].push_back({ mortonKey(points[i], x, y, z, size), (uint32_t)i });
+            }
+        });
+    }
+    pool.wait();
+
+    std::vector<MortonEntry> entries;
+    for (const auto& block : blocks) {
+        entries.insert(entries.end(), block.begin(), block.end());
+    }
+    std::vector<MortonEntry> scratch(entries.size());
+
+    pool.submit([&] {
+        buildParallelRange(pool, root, points, entries.data(), scratch.data(), 0, entries.size(), 0, config);
+    });
+    pool.wait();
+    return root;
+}
+
+// Замеряет масштабируемость параллельного построения от 1 до maxThreads потоков
+// и проверяет, что каждое построенное дерево совпадает с последовательным
+void benchmarkParallelBuild(const std::vector<Point3D>& points, float x, float y, float z, float size,
+    const OctreeConfig& config, unsigned maxThreads) {
+    using Clock = std::chrono::steady_clock;
+    auto seconds = [](Clock::duration d) { return std::chrono::duration<double>(d).count(); };
+
+    // Эталонное дерево строится в куче, замеряемые - в одной арене, которая
+    // сбрасывается между запусками и не выделяет память заново
+    Clock::time_point start = Clock::now();
+    OctreeConfig heapConfig = config;
+    heapConfig.arena = nullptr;
+    OctreeNode* reference = buildOctreeMorton(points, x, y, z, size, heapConfig);
+    double serialTime = seconds(Clock::now() - start);
+    std::cout << "Points: " << points.size() << ", serial Morton build: " << serialTime << " s\n";
+
+    std::vector<unsigned> threadCounts;
+    for (unsigned t = 1; t < maxThreads; t *= 2) {
+        threadCounts.push_back(t);
+    }
+    threadCounts.push_back(std::max(1u, maxThreads));
+
+    OctreeArena arena;
+    OctreeConfig arenaConfig = config;
+    arenaConfig.arena = &arena;
+    for (unsigned threads : threadCounts) {
+        arena.reset();
+        start = Clock::now();
+        OctreeNode* tree = buildOctreeParallel(points, x, y, z, size, arenaConfig, threads);
+        double time = seconds(Clock::now() - start);
+        std::cout << "threads " << threads << ": " << time << " s, speedup x" << serialTime / time
+            << (octreesEqual(tree, reference) ? "" : "  MISMATCH") << "\n";
+    }
+    std::cout << "Arena: " << arena.nodeCount() << " nodes, " << arena.bytesInUse() << " bytes in use, "
+        << arena.bytesReserved() << " bytes reserved\n";
+    deleteOctree(reference);
+}
+
+// Вызывает visit(point) для каждой точки поддерева node без каких-либо проверок.
+// Используется, когда узел целиком лежит внутри области запроса
+template <class Node, class Visitor>
+void forEachPointInSubtree(Node* node, Visitor visit) {
+    TraversalStack<Node*> stack;
+    stack.push(node);
+    while (!stack.empty()) {
+        node = stack.pop();
+        for (auto& point : node->points) visit(point);
+        if (node->children[0] == nullptr) continue;
+        for (int i = 7; i >= 0; --i) {
+            prefetchNode(node->children[i]);
+            stack.push(node->children[i]);
+        }
+    }
+}
+
+// Функция для поиска точек внутри сферы
+void findPointsInSphere(OctreeNode* node, float sx, float sy, float sz, float sr, std::vector<Point3D*>& result) {
+    if (!node || !node->intersectsSphere(sx, sy, sz, sr)) return;
+
+    TraversalStack<OctreeNode*> stack;
+    stack.push(node);
+    while (!stack.empty()) {
+        node = stack.pop();
+
+        // Узел целиком внутри сферы: все его точки попадают в результат без проверок
+        if (node->insideSphere(sx, sy, sz, sr)) {
+            forEachPointInSubtree(node, [&](Point3D& point) {
+                point.isInsideSphere = true;
+                result.push_back(&point);
+            });
+            continue;
+        }
+
+        // Проверяем точки, находящиеся в текущем узле
+        for (auto& point : node->points) {
+            float dx = point.x - sx;
+            float dy = point.y - sy;
+            float dz = point.z - sz;
+            if (dx * dx + dy * dy + dz * dz <= sr * sr) {
+                point.isInsideSphere = true;
+                result.push_back(&point);
+            }
+            else {
+                point.isInsideSphere = false;
+            }
+        }
+
+        // Откладываем дочерние узлы, пересекающие сферу (в обратном порядке,
+        // чтобы порядок обхода совпадал с рекурсивным)
+        if (node->children[0] == nullptr) continue;
+        for (int i = 7; i >= 0; --i) {
+            OctreeNode* child = node->children[i];
+            if (child->intersectsSphere(sx, sy, sz, sr)) {
+                prefetchNode(child);
+                stack.push(child);
+            }
+        }
+    }
+}
+
+// Функция для поиска точек внутри сферы только для чтения: дерево не меняется
+// (флаги isInsideSphere не трогаются), найденные точки добавляются в буфер
+// вызывающего. Несколько потоков могут выполнять запросы к одному дереву без блокировок
+void findPointsInSphere(const OctreeNode* node, float sx, float sy, float sz, float sr,
+    std::vector<const Point3D*>& result) {
+    if (!node || !node->intersectsSphere(sx, sy, sz, sr)) return;
+
+    TraversalStack<const OctreeNode*> stack;
+    stack.push(node);
+    while (!stack.empty()) {
+        node = stack.pop();
+        if (node->insideSphere(sx, sy, sz, sr)) {
+            forEachPointInSubtree(node, [&](const Point3D& point) { result.push_back(&point); });
+            continue;
+        }
+
+        for (const auto& point : node->points) {
+            float dx = point.x - sx;
+            float dy = point.y - sy;
+            float dz = point.z - sz;
+            if (dx * dx + dy * dy + dz * dz <= sr * sr) {
+                result.push_back(&point);
+            }
+        }
+
+        if (node->children[0] == nullptr) continue;
+        for (int i = 7; i >= 0; --i) {
+            const OctreeNode* child = node->children[i];
+            if (child->intersectsSphere(sx, sy, sz, sr)) {
+                prefetchNode(child);
+                stack.push(child);
+            }
+        }
+    }
+}
+
+// Возвращает кратность точки, найденной запросом к дереву root: число совпадающих
+// точек, слитых в эту запись (0, если указатель не принадлежит дереву)
+uint32_t pointMultiplicity(const OctreeNode* root, const Point3D* point) {
+    if (!root || !root->containsPoint(*point)) return 0;
+
+    TraversalStack<const OctreeNode*> stack;
+    stack.push(root);
+    while (!stack.empty()) {
+        const OctreeNode* node = stack.pop();
+        if (node->children[0] == nullptr) {
+            const Point3D* begin = node->points.data();
+            if (point >= begin && point < begin + node->points.size()) return pointTag(node, point - begin).multiplicity;
+            continue;
+        }
+        // Копии граничной точки могут лежать в нескольких октантах
+        for (int i = 7; i >= 0; --i) {
+            if (node->children[i]->containsPoint(*point)) stack.push(node->children[i]);
+        }
+    }
+    return 0;
+}
+
+// Общее хранилище точек дерева в виде структуры массивов (SoA). Точки
+// каждого листа лежат подряд, а лист хранит только смещение и число точек
+struct PointStore {
+    std::vector<float> x, y, z;
+    std::vector<uint32_t> multiplicity; // Кратности слитых точек (пусто, если слияний не было)
+
+    size_t size() const { return x.size(); }
+
+    // Число совпадающих точек, слитых в запись i
+    uint32_t multiplicityOf(size_t i) const { return multiplicity.empty() ? 1 : multiplicity[i]; }
+
+    // Суммарная кратность записей [first, first + count)
+    size_t weightOf(uint32_t first, uint32_t count) const {
+        if (multiplicity.empty()) return count;
+        return std::accumulate(multiplicity.begin() + first, multiplicity.begin() + first + count, (size_t)0);
+    }
+
+    void clear() {
+        x.clear();
+        y.clear();
+        z.clear();
+        multiplicity.clear();
+    }
+};
+
+// Переносит точки всех листов в store (в порядке обхода дерева) и освобождает
+// векторы листов. Точки любого поддерева оказываются подряд, и каждый узел хранит
+// их диапазон. Дальнейшие запросы к дереву идут через findPointsInSphere со store
+void packPoints(OctreeNode* node, PointStore& store) {
+    if (!node) return;
+
+    node->first = (uint32_t)store.size();
+    for (const auto& point : node->points) {
+        store.x.push_back(point.x);
+        store.y.push_back(point.y);
+        store.z.push_back(point.z);
+    }
+    // Кратности переносятся, как только встречается лист с метками; до этого все они равны 1
+    if (node->tags || !store.multiplicity.empty()) {
+        store.multiplicity.resize(node->first, 1);
+        for (size_t i = 0; i < node->points.size(); ++i) {
+            store.multiplicity.push_back(pointTag(node, i).multiplicity);
+        }
+    }
+    std::vector<Point3D>().swap(node->points);
+    node->tags.reset();
+
+    for (int i = 0; i < 8; ++i) {
+        packPoints(node->children[i], store);
+    }
+    node->count = (uint32_t)store.size() - node->first;
+}
+
+// Учёт памяти Octo-tree по составляющим
+struct OctreeMemoryStats {
+    size_t nodeCount = 0;
+    size_t leafCount = 0;
+    size_t pointEntries = 0;     // Записи точек во всех листах, включая копии граничных точек
+    size_t duplicateEntries = 0; // Копии граничных точек (записи вне октанта-владельца)
+    size_t nodeBytes = 0;        // Память самих узлов
+    size_t pointBytes = 0;       // Занятая часть векторов точек и меток листов и PointStore
+    size_t slackBytes = 0;       // Неиспользованный запас ёмкости векторов
+    size_t arenaSlackBytes = 0;  // Зарезервированная ареной, но не занятая узлами память
+    std::vector<size_t> nodesPerDepth;
+    std::vector<size_t> leavesPerDepth;
+    std::vector<size_t> pointsPerDepth;
+
+    size_t totalBytes() const { return nodeBytes + pointBytes + slackBytes + arenaSlackBytes; }
+
+    // Учитывает узел глубины depth; points - записи точек листа
+    void addNode(int depth, bool leaf, size_t points) {
+        if (nodesPerDepth.size() <= (size_t)depth) {
+            nodesPerDepth.resize(depth + 1, 0);
+            leavesPerDepth.resize(depth + 1, 0);
+            pointsPerDepth.resize(depth + 1, 0);
+        }
+        ++nodeCount;
+        ++nodesPerDepth[depth];
+        if (!leaf) return;
+        ++leafCount;
+        ++leavesPerDepth[depth];
+        pointsPerDepth[depth] += points;
+        pointEntries += points;
+    }
+
+    // Учитывает занятую и запасную память вектора
+    template <class T>
+    void addVector(const std::vector<T>& values, size_t& used) {
+        used += values.size() * sizeof(T);
+        slackBytes += (values.capacity() - values.size()) * sizeof(T);
+    }
+
+    // Байт на уникальную точку (копии граничных точек не считаются)
+    double bytesPerPoint() const {
+        size_t unique = pointEntries - duplicateEntries;
+        return unique ? (double)totalBytes() / unique : 0.0;
+    }
+};
+
+// Обходит поддерево, накапливая статистику. path - узлы-предки и номера октантов,
+// по которым шёл спуск; по ним определяется, лежит ли точка у своего владельца
+void collectMemoryStats(const OctreeNode* node, int depth, std::vector<std::pair<const OctreeNode*, int>>& path,
+    OctreeMemoryStats& stats) {
+    if (!node) return;
+    bool leaf = node->children[0] == nullptr;
+    stats.addNode(depth, leaf, leaf ? node->points.size() + node->count : 0);
+    stats.nodeBytes += sizeof(OctreeNode);
+    stats.addVector(node->points, stats.pointBytes);
+    if (node->tags) {
+        stats.pointBytes += sizeof(*node->tags);
+        stats.addVector(*node->tags, stats.pointBytes);
+    }
+
+    if (leaf) {
+        for (const auto& p : node->points) {
+            for (const auto& step : path) {
+                if (childIndexFor(step.first, p) != step.second) {
+                    ++stats.duplicateEntries;
+                    break;
+                }
+            }
+        }
+        return;
+    }
+
+    for (int i = 0; i < 8; ++i) {
+        path.emplace_back(node, i);
+        collectMemoryStats(node->children[i], depth + 1, path, stats);
+        path.pop_back();
+    }
+}
+
+// Учитывает массивы PointStore
+void addStoreStats(const PointStore& store, OctreeMemoryStats& stats) {
+    stats.addVector(store.x, stats.pointBytes);
+    stats.addVector(store.y, stats.pointBytes);
+    stats.addVector(store.z, stats.pointBytes);
+    stats.addVector(store.multiplicity, stats.pointBytes);
+}
+
+// Функция для подсчёта памяти Octo-tree. Для упакованного дерева можно передать
+// его PointStore, чтобы учесть и общий массив точек, а для дерева в арене - арену,
+// чтобы учесть зарезервированные, но не занятые узлы
+OctreeMemoryStats memoryStats(const OctreeNode* root, const PointStore* store = nullptr,
+    const OctreeArena* arena = nullptr) {
+    OctreeMemoryStats stats;
+    std::vector<std::pair<const OctreeNode*, int>> path;
+    collectMemoryStats(root, 0, path, stats);
+    if (store) addStoreStats(*store, stats);
+    if (arena) stats.arenaSlackBytes = arena->bytesReserved() - arena->bytesInUse();
+    return stats;
+}
+
+// Печатает отчёт о памяти и гистограмму узлов по глубине
+void printMemoryStats(const OctreeMemoryStats& stats, std::ostream& out = std::cout) {
+    out << "Nodes: " << stats.nodeCount << " (" << stats.leafCount << " leaves), " << stats.nodeBytes << " bytes\n";
+    out << "Points: " << stats.pointEntries << " entries (" << stats.duplicateEntries << " boundary duplicates), "
+        << stats.pointBytes << " bytes, " << stats.slackBytes << " bytes of capacity slack\n";
+    if (stats.arenaSlackBytes) out << "Arena: " << stats.arenaSlackBytes << " bytes reserved but unused\n";
+    out << "Total: " << stats.totalBytes() << " bytes, " << stats.bytesPerPoint() << " bytes/point\n";
+
+    if (stats.nodesPerDepth.empty()) return;
+    size_t widest = *std::max_element(stats.nodesPerDepth.begin(), stats.nodesPerDepth.end());
+    for (size_t depth = 0; depth < stats.nodesPerDepth.size(); ++depth) {
+        size_t bar = widest ? (stats.nodesPerDepth[depth] * 40 + widest - 1) / widest : 0;
+        out << "depth " << depth << ": " << std::string(bar, '#') << " " << stats.nodesPerDepth[depth] << " nodes, "
+            << stats.leavesPerDepth[depth] << " leaves, " << stats.pointsPerDepth[depth] << " points\n";
+    }
+}
+
+// Векторные ядра проверки точек листа. GCC и Clang собирают каждое ядро под свой
+// набор инструкций атрибутом target, MSVC разрешает интринсики без флагов
+#if defined(_MSC_VER) && !defined(__clang__)
+#define OCTREE_TARGET(features)
+#else
+#define OCTREE_TARGET(features) __attribute__((target(features)))
+#endif
+
+// Набор векторных инструкций, доступный на процессоре
+enum class SimdLevel { Scalar, SSE2, AVX2, AVX512 };
+
+const char* simdLevelName(SimdLevel level) {
+    switch (level) {
+    case SimdLevel::SSE2: return "SSE2";
+    case SimdLevel::AVX2: return "AVX2";
+    case SimdLevel::AVX512: return "AVX-512";
+    default: return "scalar";
+    }
+}
+
+#ifdef OCTREE_X86
+void readCpuid(int info[4], int leaf, int subleaf) {
+#if defined(_MSC_VER)
+    __cpuidex(info, leaf, subleaf);
+#else
+    unsigned a, b, c, d;
+    __cpuid_count(leaf, subleaf, a, b, c, d);
+    info[0] = (int)a;
+    info[1] = (int)b;
+    info[2] = (int)c;
+    info[3] = (int)d;
+#endif
+}
+
+// Регистр XCR0: какие векторные регистры сохраняет операционная система
+unsigned long long readXcr0() {
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    unsigned lo, hi;
+    __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    return ((unsigned long long)hi << 32) | lo;
+#endif
+}
+#endif
+
+// Определяет лучший набор инструкций по CPUID. AVX2 и AVX-512 учитываются, только
+// если ОС сохраняет регистры YMM и ZMM (бит OSXSAVE и XCR0)
+SimdLevel detectSimdLevel() {
+#ifdef OCTREE_X86
+    int info[4];
+    readCpuid(info, 0, 0);
+    int maxLeaf = info[0];
+
+    readCpuid(info, 1, 0);
+    bool sse2 = (info[3] & (1 << 26)) != 0;
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+    unsigned long long xcr0 = osxsave ? readXcr0() : 0;
+    bool ymmEnabled = (xcr0 & 0x6) == 0x6;
+    bool zmmEnabled = (xcr0 & 0xE6) == 0xE6;
+
+    int extended = 0;
+    if (maxLeaf >= 7) {
+        readCpuid(info, 7, 0);
+        extended = info[1];
+    }
+    if (avx && zmmEnabled && (extended & (1 << 16))) return SimdLevel::AVX512;
+    if (avx && ymmEnabled && (extended & (1 << 5))) return SimdLevel::AVX2;
+    if (sse2) return SimdLevel::SSE2;
+#endif
+    return SimdLevel::Scalar;
+}
+
+// Ядро проверки точек листа: записывает в out индексы i из [first, first + count),
+// для которых точка (px[i], py[i], pz[i]) лежит внутри сферы, и возвращает их число.
+// В out должно быть место для count индексов
+typedef size_t (*SphereLeafKernel)(const float* px, const float* py, const float* pz, uint32_t first, uint32_t count,
+    float sx, float sy, float sz, float radiusSquared, uint32_t* out);
+
+// Без ветвлений: индекс пишется всегда, а счётчик растёт только при попадании
+size_t sphereLeafKernelScalar(const float* px, const float* py, const float* pz, uint32_t first, uint32_t count,
+    float sx, float sy, float sz, float radiusSquared, uint32_t* out) {
+    size_t found = 0;
+    for (uint32_t i = first; i < first + count; ++i) {
+        float dx = px[i] - sx;
+        float dy = py[i] - sy;
+        float dz = pz[i] - sz;
+        out[found] = i;
+        found += (dx * dx + dy * dy + dz * dz <= radiusSquared) ? 1 : 0;
+    }
+    return found;
+}
+
+#ifdef OCTREE_X86
+// 4 точки за шаг; биты маски сравнения переводятся в индексы без ветвлений,
+// блоки без попаданий пропускаются целиком
+OCTREE_TARGET("sse2")
+size_t sphereLeafKernelSSE2(const float* px, const float* py, const float* pz, uint32_t first, uint32_t count,
+    float sx, float sy, float sz, float radiusSquared, uint32_t* out) {
+    const __m128 cx = _mm_set1_ps(sx);
+    const __m128 cy = _mm_set1_ps(sy);
+    const __m128 cz = _mm_set1_ps(sz);
+    const __m128 r2 = _mm_set1_ps(radiusSquared);
+    size_t found = 0;
+    uint32_t i = first;
+    uint32_t end = first + count;
+    for (; i + 4 <= end; i += 4) {
+        __m128 dx = _mm_sub_ps(_mm_loadu_ps(px + i), cx);
+        __m128 dy = _mm_sub_ps(_mm_loadu_ps(py + i), cy);
+        __m128 dz = _mm_sub_ps(_mm_loadu_ps(pz + i), cz);
+        __m128 d2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+        int mask = _mm_movemask_ps(_mm_cmple_ps(d2, r2));
+        if (mask == 0) continue;
+        for (int k = 0; k < 4; ++k) {
+            out[found] = i + k;
+            found += (mask >> k) & 1;
+        }
+    }
+    return found + sphereLeafKernelScalar(px, py, pz, i, end - i, sx, sy, sz, radiusSquared, out + found);
+}
+
+// 8 точек за шаг
+OCTREE_TARGET("avx2")
+size_t sphereLeafKernelAVX2(const float* px, const float* py, const float* pz, uint32_t first, uint32_t count,
+    float sx, float sy, float sz, float radiusSquared, uint32_t* out) {
+    const __m256 cx = _mm256_set1_ps(sx);
+    const __m256 cy = _mm256_set1_ps(sy);
+    const __m256 cz = _mm256_set1_ps(sz);
+    const __m256 r2 = _mm256_set1_ps(radiusSquared);
+    size_t found = 0;
+    uint32_t i = first;
+    uint32_t end = first + count;
+    for (; i + 8 <= end; i += 8) {
+        __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(px + i), cx);
+        __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(py + i), cy);
+        __m256 dz = _mm256_sub_ps(_mm256_loadu_ps(pz + i), cz);
+        __m256 d2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+        int mask = _mm256_movemask_ps(_mm256_cmp_ps(d2, r2, _CMP_LE_OQ));
+        if (mask == 0) continue;
+        for (int k = 0; k < 8; ++k) {
+            out[found] = i + k;
+            found += (mask >> k) & 1;
+        }
+    }
+    return found + sphereLeafKernelScalar(px, py, pz, i, end - i, sx, sy, sz, radiusSquared, out + found);
+}
+
+// 16 точек за шаг; хвост листа читается маскированной загрузкой, а индексы
+// попавших точек записываются подряд инструкцией compress-store
+OCTREE_TARGET("avx512f,popcnt")
+size_t sphereLeafKernelAVX512(const float* px, const float* py, const float* pz, uint32_t first, uint32_t count,
+    float sx, float sy, float sz, float radiusSquared, uint32_t* out) {
+    const __m512 cx = _mm512_set1_ps(sx);
+    const __m512 cy = _mm512_set1_ps(sy);
+    const __m512 cz = _mm512_set1_ps(sz);
+    const __m512 r2 = _mm512_set1_ps(radiusSquared);
+    const __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    size_t found = 0;
+    uint32_t end = first + count;
+    for (uint32_t i = first; i < end; i += 16) {
+        __mmask16 valid = (end - i >= 16) ? (__mmask16)0xFFFF : (__mmask16)((1u << (end - i)) - 1);
+        __m512 dx = _mm512_sub_ps(_mm512_maskz_loadu_ps(valid, px + i), cx);
+        __m512 dy = _mm512_sub_ps(_mm512_maskz_loadu_ps(valid, py + i), cy);
+        __m512 dz = _mm512_sub_ps(_mm512_maskz_loadu_ps(valid, pz + i), cz);
+        __m512 d2 = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dx, dx), _mm512_mul_ps(dy, dy)), _mm512_mul_ps(dz, dz));
+        __mmask16 hits = _mm512_mask_cmp_ps_mask(valid, d2, r2, _CMP_LE_OQ);
+        __m512i indices = _mm512_add_epi32(_mm512_set1_epi32((int)i), lanes);
+        _mm512_mask_compressstoreu_epi32(out + found, hits, indices);
+        found += _mm_popcnt_u32(hits);
+    }
+    return found;
+}
+#endif
+
+// Ядро для заданного набора инструкций
+SphereLeafKernel sphereLeafKernelFor(SimdLevel level) {
+#ifdef OCTREE_X86
+    switch (level) {
+    case SimdLevel::AVX512: return sphereLeafKernelAVX512;
+    case SimdLevel::AVX2: return sphereLeafKernelAVX2;
+    case SimdLevel::SSE2: return sphereLeafKernelSSE2;
+    default: break;
+    }
+#endif
+    return sphereLeafKernelScalar;
+}
+
+// Ядро для текущего процессора; выбирается один раз при первом вызове
+SphereLeafKernel sphereLeafKernel() {
+    static const SphereLeafKernel kernel = sphereLeafKernelFor(detectSimdLevel());
+    return kernel;
+}
+
+// Проверяет точки [first, first + count) из store и добавляет в result индексы
+// точек внутри сферы
+void scanLeafInSphere(SphereLeafKernel kernel, const PointStore& store, uint32_t first, uint32_t count,
+    float sx, float sy, float sz, float sr, std::vector<uint32_t>& result) {
+    if (count == 0) return;
+    size_t base = result.size();
+    result.resize(base + count);
+    size_t found = kernel(store.x.data(), store.y.data(), store.z.data(), first, count, sx, sy, sz, sr * sr, result.data() + base);
+    result.resize(base + found);
+}
+
+// Добавляет в result все индексы [first, first + count) без проверок
+void appendPointRange(uint32_t first, uint32_t count, std::vector<uint32_t>& result) {
+    size_t base = result.size();
+    result.resize(base + count);
+    std::iota(result.begin() + base, result.end(), first);
+}
+
+// Функция для поиска точек внутри сферы в дереве с упакованными точками.
+// В result добавляются индексы точек в store
+void findPointsInSphere(const OctreeNode* node, const PointStore& store, float sx, float sy, float sz, float sr,
+    std::vector<uint32_t>& result) {
+    if (!node || !cubeIntersectsSphere(node->x, node->y, node->z, node->size, sx, sy, sz, sr)) return;
+
+    // Координаты точек листа идут подряд в трёх отдельных массивах, поэтому
+    // лист проверяется векторным ядром, а поддерево целиком внутри сферы
+    // добавляется одним диапазоном
+    SphereLeafKernel kernel = sphereLeafKernel();
+    TraversalStack<const OctreeNode*> stack;
+    stack.push(node);
+    while (!stack.empty()) {
+        node = stack.pop();
+        if (node->insideSphere(sx, sy, sz, sr)) {
+            appendPointRange(node->first, node->count, result);
+            continue;
+        }
+        if (node->children[0] == nullptr) {
+            scanLeafInSphere(kernel, store, node->first, node->count, sx, sy, sz, sr, result);
+            continue;
+        }
+        for (int i = 7; i >= 0; --i) {
+            const OctreeNode* child = node->children[i];
+            if (cubeIntersectsSphere(child->x, child->y, child->z, child->size, sx, sy, sz, sr)) {
+                prefetchNode(child);
+                stack.push(child);
+            }
+        }
+    }
+}
+
+// Функция для подсчёта точек внутри сферы в дереве с упакованными точками; слитые
+// записи учитываются с их кратностью. Для поддерева целиком внутри сферы берётся
+// готовое число его точек
+size_t countPointsInSphere(const OctreeNode* node, const PointStore& store, float sx, float sy, float sz, float sr) {
+    if (!node || !node->intersectsSphere(sx, sy, sz, sr)) return 0;
+
+    size_t total = 0;
+    TraversalStack<const OctreeNode*> stack;
+    stack.push(node);
+    while (!stack.empty()) {
+        node = stack.pop();
+        if (node->insideSphere(sx, sy, sz, sr)) {
+            total += store.weightOf(node->first, node->count);
+            continue;
+        }
+        if (node->children[0] == nullptr) {
+            for (uint32_t i = node->first; i < node->first + node->count; ++i) {
+                float dx = store.x[i] - sx;
+                float dy = store.y[i] - sy;
+                float dz = store.z[i] - sz;
+                total += (dx * dx + dy * dy + dz * dz <= sr * sr) ? store.multiplicityOf(i) : 0;
+            }
+            continue;
+        }
+        for (int i = 7; i >= 0; --i) {
+            const OctreeNode* child = node->children[i];
+            if (child->intersectsSphere(sx, sy, sz, sr)) stack.push(child);
+        }
+    }
+    return total;
+}
+
+// Проверяет точки [first, first + count) из store и добавляет в result индексы
+// точек внутри параллелепипеда [min, max]. Индекс пишется всегда, а счётчик растёт
+// только при попадании
+void scanLeafInBox(const PointStore& store, uint32_t first, uint32_t count, float minX, float minY, float minZ,
+    float maxX, float maxY, float maxZ, std::vector<uint32_t>& result) {
+    if (count == 0) return;
+    size_t base = result.size();
+    result.resize(base + count);
+    uint32_t* out = result.data() + base;
+    size_t found = 0;
+    for (uint32_t i = first; i < first + count; ++i) {
+        float px = store.x[i], py = store.y[i], pz = store.z[i];
+        out[found] = i;
+        found += (px >= minX) & (px <= maxX) & (py >= minY) & (py <= maxY) & (pz >= minZ) & (pz <= maxZ);
+    }
+    result.resize(base + found);
+}
+
+// Функция для поиска точек внутри параллелепипеда [min, max] (границы включены).
+// Дерево не изменяется, найденные точки добавляются в буфер вызывающего; поддерево
+// целиком внутри параллелепипеда принимается без проверки точек
+void findPointsInBox(const OctreeNode* node, float minX, float minY, float minZ, float maxX, float maxY, float maxZ,
+    std::vector<const Point3D*>& result) {
+    if (!node || !node->intersectsBox(minX, minY, minZ, maxX, maxY, maxZ)) return;
+
+    TraversalStack<const OctreeNode*> stack;
+    stack.push(node);
+    while (!stack.empty()) {
+        node = stack.pop();
+        if (node->insideBox(minX, minY, minZ, maxX, maxY, maxZ)) {
+            forEachPointInSubtree(node, [&](const Point3D& point) { result.push_back(&point); });
+            continue;
+        }
+
+        for (const auto& point : node->points) {
+            if (point.x >= minX && point.x <= maxX && point.y >= minY && point.y <= maxY &&
+                point.z >= minZ && point.z <= maxZ) {
+                result.push_back(&point);
+            }
+        }
+
+        if (node->children[0] == nullptr) continue;
+        for (int i = 7; i >= 0; --i) {
+            const OctreeNode* child = node->children[i];
+            if (child->intersectsBox(minX, minY, minZ, maxX, maxY, maxZ)) {
+                prefetchNode(child);
+                stack.push(child);
+            }
+        }
+    }
+}
+
+// Функция для поиска точек внутри параллелепипеда в дереве с упакованными точками.
+// В result добавляются индексы точек в store
+void findPointsInBox(const OctreeNode* node, const PointStore& store, float minX, float minY, float minZ,
+    float maxX, float maxY, float maxZ, std::vector<uint32_t>& result) {
+    if (!node || !node->intersectsBox(minX, minY, minZ, maxX, maxY, maxZ)) return;
+
+    TraversalStack<const OctreeNode*> stack;
+    stack.push(node);
+    while (!stack.empty()) {
+        node = stack.pop();
+        if (node->insideBox(minX, minY, minZ, maxX, maxY, maxZ)) {
+            appendPointRange(node->first, node->count, result);
+            continue;
+        }
+        if (node->children[0] == nullptr) {
+            scanLeafInBox(store, node->first, node->count, minX, minY, minZ, maxX, maxY, maxZ, result);
+            continue;
+        }
+        for (int i = 7; i >= 0; --i) {
+            const OctreeNode* child = node->children[i];
+            if (child->intersectsBox(minX, minY, minZ, maxX, maxY, maxZ)) {
+                prefetchNode(child);
+                stack.push(child);
+            }
+        }
+    }
+}
+
+// Сфера запроса для пакетного поиска
+struct QuerySphere {
+    float x, y, z; // Центр
+    float r;       // Радиус
+};
+
+// Часть результата одной сферы: диапазон индексов принятого целиком поддерева
+// или отрезок буфера попаданий, найденных при проверке листа
+struct SphereBatchPiece {
+    uint32_t sphere;
+    uint32_t first;
+    uint32_t count;
+    bool wholeRange;
+};
+
+// Результат пакетного запроса в формате CSR: точки сферы q - это индексы
+// indices[offsets[q]] ... indices[offsets[q + 1] - 1] в PointStore. Рабочие
+// буферы сохраняются между вызовами, чтобы повторные пакеты не выделяли память
+struct SphereBatchResult {
+    std::vector<uint32_t> offsets;
+    std::vector<uint32_t> indices;
+
+    size_t sphereCount() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+    size_t countFor(size_t q) const { return offsets[q + 1] - offsets[q]; }
+    const uint32_t* begin(size_t q) const { return indices.data() + offsets[q]; }
+    const uint32_t* end(size_t q) const { return indices.data() + offsets[q + 1]; }
+
+    std::vector<uint32_t> active;         // Сферы, активные в узлах стека обхода
+    std::vector<uint32_t> hits;           // Попадания, найденные в листах
+    std::vector<SphereBatchPiece> pieces; // Части результатов в порядке обхода
+};
+
+// Номер сферы в буфере активных сфер занимает младшие 24 бита, поэтому за один
+// проход обрабатывается не больше 2^24 сфер
+const size_t kMaxSpheresPerPass = size_t(1) << 24;
+
+// Узел в стеке пакетного обхода и отрезок [begin, end) активных для него сфер
+struct SphereBatchFrame {
+    const OctreeNode* node;
+    uint32_t begin, end;
+};
+
+// Функция для поиска точек внутри многих сфер за один обход дерева с упакованными
+// точками. Вниз по дереву передаётся набор сфер, пересекающих узел; спуск
+// прекращается, когда набор пуст. Сфера, целиком содержащая узел, получает весь
+// его диапазон, а каждый лист проверяется сразу для всех оставшихся сфер.
+// Пакет больше kMaxSpheresPerPass сфер обходится по частям
+void findPointsInSpheres(const OctreeNode* root, const PointStore& store, const QuerySphere* spheres, size_t count,
+    SphereBatchResult& result) {
+    if (count > kMaxSpheresPerPass) {
+        SphereBatchResult part;
+        result.offsets.assign(1, 0);
+        result.indices.clear();
+        for (size_t begin = 0; begin < count; begin += kMaxSpheresPerPass) {
+            size_t partCount = std::min(kMaxSpheresPerPass, count - begin);
+            findPointsInSpheres(root, store, spheres + begin, partCount, part);
+            uint32_t base = (uint32_t)result.indices.size();
+            result.indices.insert(result.indices.end(), part.indices.begin(), part.indices.end());
+            for (size_t q = 1; q <= partCount; ++q) {
+                result.offsets.push_back(base + part.offsets[q]);
+            }
+        }
+        return;
+    }
+
+    result.offsets.assign(count + 1, 0);
+    result.indices.clear();
+    result.active.clear();
+    result.hits.clear();
+    result.pieces.clear();
+    if (!root) return;
+
+    // Номер сферы занимает младшие 24 бита; старшие 8 - маска дочерних узлов
+    std::vector<uint32_t>& active = result.active;
+    for (uint32_t q = 0; q < count; ++q) {
+        active.push_back(q);
+    }
+
+    SphereLeafKernel kernel = sphereLeafKernel();
+    TraversalStack<SphereBatchFrame> stack;
+    stack.push(SphereBatchFrame{ root, 0, (uint32_t)active.size() });
+    while (!stack.empty()) {
+        SphereBatchFrame frame = stack.pop();
+        // Отрезки сфер уже обработанных узлов лежат выше отрезка текущего узла
+        active.resize(frame.end);
+        const OctreeNode* node = frame.node;
+        bool leaf = node->children[0] == nullptr;
+
+        // Сфера отбрасывается, если не пересекает узел. Для остальных по положению
+        // относительно плоскостей деления узла вычисляется маска дочерних узлов,
+        // которых касается её ограничивающий куб (кубы детей замкнуты, поэтому
+        // касание плоскости деления относится к обеим сторонам); маска хранится
+        // рядом с номером сферы
+        uint32_t kept = frame.begin;
+        for (uint32_t a = frame.begin; a < frame.end; ++a) {
+            uint32_t q = active[a];
+            const QuerySphere& sphere = spheres[q];
+            if (!node->intersectsSphere(sphere.x, sphere.y, sphere.z, sphere.r)) continue;
+            if (node->insideSphere(sphere.x, sphere.y, sphere.z, sphere.r)) {
+                result.pieces.push_back(SphereBatchPiece{ q, node->first, node->count, true });
+            }
+            else if (leaf) {
+                size_t base = result.hits.size();
+                scanLeafInSphere(kernel, store, node->first, node->count, sphere.x, sphere.y, sphere.z, sphere.r, result.hits);
+                if (result.hits.size() > base) {
+                    result.pieces.push_back(SphereBatchPiece{ q, (uint32_t)base, (uint32_t)(result.hits.size() - base), false });
+                }
+            }
+            else {
+                uint32_t lowX = sphere.x - sphere.r <= node->x, highX = sphere.x + sphere.r >= node->x;
+                uint32_t lowY = sphere.y - sphere.r <= node->y, highY = sphere.y + sphere.r >= node->y;
+                uint32_t lowZ = sphere.z - sphere.r <= node->z, highZ = sphere.z + sphere.r >= node->z;
+                uint32_t maskX = lowX * 0x55 | highX * 0xAA;
+                uint32_t maskY = lowY * 0x33 | highY * 0xCC;
+                uint32_t maskZ = lowZ * 0x0F | highZ * 0xF0;
+                active[kept++] = q | ((maskX & maskY & maskZ) << 24);
+            }
+        }
+        if (leaf || kept == frame.begin) continue;
+
+        // Пересечение с дочерним узлом проверяется уже при его обработке
+        for (int i = 7; i >= 0; --i) {
+            uint32_t childBegin = (uint32_t)active.size();
+            for (uint32_t a = frame.begin; a < kept; ++a) {
+                if (active[a] & (1u << (24 + i))) active.push_back(active[a] & 0xFFFFFF);
+            }
+            if (active.size() > childBegin) {
+                prefetchNode(node->children[i]);
+                stack.push(SphereBatchFrame{ node->children[i], childBegin, (uint32_t)active.size() });
+            }
+        }
+    }
+
+    // Собираем CSR: число точек каждой сферы, смещения и копирование частей по местам
+    for (const auto& piece : result.pieces) {
+        result.offsets[piece.sphere + 1] += piece.count;
+    }
+    for (size_t q = 0; q < count; ++q) {
+        result.offsets[q + 1] += result.offsets[q];
+    }
+    result.indices.resize(result.offsets[count]);
+    std::vector<uint32_t>& cursor = active;
+    cursor.assign(result.offsets.begin(), result.offsets.end() - 1);
+    for (const auto& piece : result.pieces) {
+        uint32_t* out = result.indices.data() + cursor[piece.sphere];
+        if (piece.wholeRange) {
+            std::iota(out, out + piece.count, piece.first);
+        }
+        else {
+            std::copy(result.hits.begin() + piece.first, result.hits.begin() + piece.first + piece.count, out);
+        }
+        cursor[piece.sphere] += piece.count;
+    }
+}
+
+void findPointsInSpheres(const OctreeNode* root, const PointStore& store, const std::vector<QuerySphere>& spheres,
+    SphereBatchResult& result) {
+    findPointsInSpheres(root, store, spheres.data(), spheres.size(), result);
+}
+
+// Поиск k ближайших соседей по принципу "сначала лучший": узлы извлекаются из
+// очереди в порядке расстояния до их куба, а найденные точки копятся в max-куче
+// размера k. Как только ближайший необработанный узел дальше k-й найденной точки,
+// поиск заканчивается. scanLeaf(leaf, offer) передаёт точки листа в offer(d2, entry).
+// В best остаются пары (квадрат расстояния, entry) по возрастанию расстояния
+template <class Entry, class LeafScan>
+void knnSearch(const OctreeNode* root, float x, float y, float z, size_t k, std::vector<std::pair<float, Entry>>& best,
+    LeafScan scanLeaf) {
+    typedef std::pair<float, Entry> Candidate;
+    typedef std::pair<float, const OctreeNode*> QueuedNode;
+    auto closer = [](const Candidate& a, const Candidate& b) { return a.first < b.first; };
+    auto farther = [](const QueuedNode& a, const QueuedNode& b) { return a.first > b.first; };
+
+    best.clear();
+    if (!root || k == 0) return;
+
+    // Кандидат вытесняет самую дальнюю из k найденных точек
+    auto offer = [&](float distanceSquared, Entry entry) {
+        if (best.size() < k) {
+            best.emplace_back(distanceSquared, entry);
+            std::push_heap(best.begin(), best.end(), closer);
+        }
+        else if (distanceSquared < best.front().first) {
+            std::pop_heap(best.begin(), best.end(), closer);
+            best.back() = Candidate(distanceSquared, entry);
+            std::push_heap(best.begin(), best.end(), closer);
+        }
+    };
+    auto worthVisiting = [&](float distanceSquared) {
+        return best.size() < k || distanceSquared < best.front().first;
+    };
+
+    std::vector<QueuedNode> queue;
+    queue.emplace_back(root->distanceSquaredTo(x, y, z), root);
+    while (!queue.empty()) {
+        std::pop_heap(queue.begin(), queue.end(), farther);
+        QueuedNode current = queue.back();
+        queue.pop_back();
+        if (!worthVisiting(current.first)) break;
+
+        const OctreeNode* node = current.second;
+        if (node->children[0] == nullptr) {
+            scanLeaf(node, offer);
+            continue;
+        }
+        for (int i = 0; i < 8; ++i) {
+            const OctreeNode* child = node->children[i];
+            float distanceSquared = child->distanceSquaredTo(x, y, z);
+            if (!worthVisiting(distanceSquared)) continue;
+            prefetchNode(child);
+            queue.emplace_back(distanceSquared, child);
+            std::push_heap(queue.begin(), queue.end(), farther);
+        }
+    }
+    std::sort_heap(best.begin(), best.end(), closer);
+}
+
+// Функция для поиска k ближайших к (x, y, z) точек в дереве с упакованными точками.
+// В result добавляются индексы точек в store в порядке возрастания расстояния
+// (меньше k, если в дереве меньше точек). Копии граничных точек при маршрутизации
+// AllChildren считаются отдельными точками
+void knn(const OctreeNode* root, const PointStore& store, float x, float y, float z, size_t k,
+    std::vector<uint32_t>& result) {
+    std::vector<std::pair<float, uint32_t>> best;
+    knnSearch(root, x, y, z, k, best, [&](const OctreeNode* leaf, auto& offer) {
+        for (uint32_t i = leaf->first; i < leaf->first + leaf->count; ++i) {
+            float dx = store.x[i] - x;
+            float dy = store.y[i] - y;
+            float dz = store.z[i] - z;
+            offer(dx * dx + dy * dy + dz * dz, i);
+        }
+    });
+    for (const auto& candidate : best) {
+        result.push_back(candidate.second);
+    }
+}
+
+// Функция для поиска k ближайших к (x, y, z) точек в дереве без упаковки.
+// Дерево не изменяется; в result добавляются точки в порядке возрастания расстояния
+void knn(const OctreeNode* root, float x, float y, float z, size_t k, std::vector<const Point3D*>& result) {
+    std::vector<std::pair<float, const Point3D*>> best;
+    knnSearch(root, x, y, z, k, best, [&](const OctreeNode* leaf, auto& offer) {
+        for (const auto& point : leaf->points) {
+            float dx = point.x - x;
+            float dy = point.y - y;
+            float dz = point.z - z;
+            offer(dx * dx + dy * dy + dz * dz, &point);
+        }
+    });
+    for (const auto& candidate : best) {
+        result.push_back(candidate.second);
+    }
+}
+
+// Подбирает вместимость листа по реальным данным: для каждого кандидата строит
+// дерево по выборке sample, упаковывает точки и замеряет пропускную способность
+// запросов сферой радиуса queryRadius с центрами в точках выборки.
+// Возвращает config с лучшей найденной вместимостью
+OctreeConfig tuneLeafCapacity(const std::vector<Point3D>& sample, float x, float y, float z, float size, float queryRadius,
+    OctreeConfig config = OctreeConfig(), const std::vector<int>& candidates = { 4, 8, 16, 32, 64, 128, 256 },
+    size_t queryCount = 2000) {
+    using Clock = std::chrono::steady_clock;
+    if (sample.empty() || candidates.empty()) return config;
+
+    OctreeArena* userArena = config.arena;
+    int bestCapacity = config.maxPoints;
+    double bestRate = 0;
+    for (int capacity : candidates) {
+        OctreeArena arena;
+        OctreeConfig candidate = config;
+        candidate.maxPoints = capacity;
+        candidate.arena = &arena;
+        OctreeNode* root = buildOctreeMorton(sample, x, y, z, size, candidate);
+        PointStore store;
+        packPoints(root, store);
+
+        std::vector<uint32_t> result;
+        size_t hits = 0;
+        Clock::time_point start = Clock::now();
+        for (size_t q = 0; q < queryCount; ++q) {
+            const Point3D& centre = sample[(q * 7919) % sample.size()];
+            result.clear();
+            findPointsInSphere(root, store, centre.x, centre.y, centre.z, queryRadius, result);
+            hits += result.size();
+        }
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        double rate = queryCount / std::max(seconds, 1e-9);
+        std::cout << "leaf capacity " << capacity << ": " << rate << " queries/s, " << arena.nodeCount() << " nodes, "
+            << hits / queryCount << " hits/query\n";
+
+        if (rate > bestRate) {
+            bestRate = rate;
+            bestCapacity = capacity;
+        }
+    }
+
+    config.maxPoints = bestCapacity;
+    config.arena = userArena;
+    std::cout << "Best leaf capacity: " << bestCapacity << "\n";
+    return config;
+}
+
+// Узел линейного Octo-tree (без указателей). Ключ узла - locational code:
+// бит-маркер 1, за которым идут по 3 бита номера октанта на каждый уровень
+// (корень имеет код 1). Дочерние узлы имеют коды (code << 3) | i
+struct LinearOctreeNode {
+    uint64_t code;
+    uint32_t first;  // Начало точек листа в LinearOctree::points; у внутреннего узла - индекс первого ребёнка
+    uint32_t count;  // Число точек листа; kLinearInternalNode у внутренних узлов
+};
+
+const uint32_t kLinearInternalNode = 0xffffffffu;
+
+// Линейное Octo-tree: все узлы лежат в одном массиве, отсортированном по коду
+// (уровень за уровнем, внутри уровня - в порядке Мортона), точки листов - в одном
+// массиве в порядке Мортона. Такой порядок совпадает с обходом в ширину, а у
+// внутреннего узла всегда 8 детей, поэтому дети k-го по порядку внутреннего узла
+// начинаются с индекса 1 + 8 * k. Этот индекс вычисляется при построении, без указателей
+struct LinearOctree {
+    float x, y, z;                    // Центр корня
+    float size;                       // Размер корня
+    std::vector<LinearOctreeNode> nodes;
+    std::vector<Point3D> points;
+
+    // Возвращает индекс первого из 8 дочерних узлов или -1, если узел - лист
+    long long firstChild(size_t index) const {
+        if (nodes[index].count != kLinearInternalNode) return -1;
+        return nodes[index].first;
+    }
+};
 
-    OctreeNode(float x, float y, float z, float size) : x(x), y(y), z(z), size(size) {
-        for (int i = 0; i < 8; ++i) {
-            children[i] = nullptr;
+// Добавляет узлы поддерева с кодом code для отсортированного диапазона ключей [begin, end)
+void buildLinearRange(LinearOctree& tree, const std::vector<Point3D>& points, const std::vector<MortonEntry>& entries,
+    size_t begin, size_t end, uint64_t code, int level, const OctreeConfig& config) {
+    if (end - begin <= (size_t)config.maxPoints || level >= std::min(config.maxDepth, kMortonBitsPerAxis)) {
+        tree.nodes.push_back({ code, (uint32_t)tree.points.size(), (uint32_t)(end - begin) });
+        for (size_t i = begin; i < end; ++i) {
+            tree.points.push_back(points[entries[i].index]);
         }
+        return;
     }
 
-    // Проверяет, содержится ли точка внутри текущего узла
-    bool containsPoint(const Point3D& point) {
-        return (point.x >= x - size / 2 && point.x <= x + size / 2 &&
-            point.y >= y - size / 2 && point.y <= y + size / 2 &&
-            point.z >= z - size / 2 && point.z <= z + size / 2);
+    tree.nodes.push_back({ code, 0, kLinearInternalNode });
+    int shift = 3 * (kMortonBitsPerAxis - 1 - level);
+    size_t childBegin = begin;
+    for (int i = 0; i < 8; ++i) {
+        size_t childEnd = std::partition_point(entries.begin() + childBegin, entries.begin() + end,
+            [&](const MortonEntry& e) { return (int)((e.key >> shift) & 7) <= i; }) - entries.begin();
+        buildLinearRange(tree, points, entries, childBegin, childEnd, code << 3 | i, level + 1, config);
+        childBegin = childEnd;
     }
+}
 
-    // Проверяет, пересекается ли узел со сферой
-    bool intersectsSphere(float sx, float sy, float sz, float sr) {
-        float dx = std::max(x - size / 2, std::min(sx, x + size / 2)) - sx;
-        float dy = std::max(y - size / 2, std::min(sy, y + size / 2)) - sy;
-        float dz = std::max(z - size / 2, std::min(sz, z + size / 2)) - sz;
-        return (dx * dx + dy * dy + dz * dz) <= (sr * sr);
+// Функция для построения линейного Octo-tree. Структура дерева и точки в листах
+// совпадают с деревом buildOctreeMorton с теми же параметрами
+LinearOctree buildLinearOctree(const std::vector<Point3D>& points, float x, float y, float z, float size,
+    const OctreeConfig& config = OctreeConfig()) {
+    LinearOctree tree{ x, y, z, size, {}, {} };
+
+    std::vector<MortonEntry> entries;
+    entries.reserve(points.size());
+    for (size_t i = 0; i < points.size(); ++i) {
+        const Point3D& p = points[i];
+        if (std::abs(p.x - x) > size / 2 || std::abs(p.y - y) > size / 2 || std::abs(p.z - z) > size / 2) continue;
+        entries.push_back({ mortonKey(p, x, y, z, size), (uint32_t)i });
     }
-};
+    radixSortMorton(entries);
 
-// Функция для вставки точки в Octo-tree
-void insertPoint(OctreeNode* node, const Point3D& point, int maxPoints = 4) {
-    if (!node->containsPoint(point)) return;
+    tree.points.reserve(entries.size());
+    buildLinearRange(tree, points, entries, 0, entries.size(), 1, 0, config);
 
-    // Если узел ещё не разделён и в нём меньше точек, чем maxPoints, добавляем точку
-    if (node->points.size() < maxPoints && node->children[0] == nullptr) {
-        node->points.push_back(point);
-        return;
+    // Узлы добавлялись в глубину; сортировка по коду кладёт братьев подряд
+    std::sort(tree.nodes.begin(), tree.nodes.end(),
+        [](const LinearOctreeNode& a, const LinearOctreeNode& b) { return a.code < b.code; });
+
+    // Ранг внутреннего узла среди внутренних узлов даёт индекс его первого ребёнка
+    uint32_t internalRank = 0;
+    for (auto& node : tree.nodes) {
+        if (node.count == kLinearInternalNode) node.first = 1 + 8 * internalRank++;
     }
+    return tree;
+}
 
-    // Если узел переполнен, разделяем его на 8 дочерних узлов
-    if (node->children[0] == nullptr) {
-        float half = node->size / 2;
+// Узел линейного Octo-tree в стеке обхода: индекс, центр и размер куба
+struct LinearQueryFrame {
+    size_t index;
+    float x, y, z;
+    float size;
+};
+
+// Функция для поиска точек внутри сферы в линейном Octo-tree. Дерево не изменяется,
+// найденные точки добавляются в буфер вызывающего. Центры и размеры узлов
+// вычисляются по ходу спуска
+void findPointsInSphereLinear(const LinearOctree& tree, float sx, float sy, float sz, float sr,
+    std::vector<const Point3D*>& result) {
+    if (tree.nodes.empty()) return;
+
+    TraversalStack<LinearQueryFrame> stack;
+    stack.push({ 0, tree.x, tree.y, tree.z, tree.size });
+    while (!stack.empty()) {
+        LinearQueryFrame frame = stack.pop();
+        if (!cubeIntersectsSphere(frame.x, frame.y, frame.z, frame.size, sx, sy, sz, sr)) continue;
+
+        const LinearOctreeNode& node = tree.nodes[frame.index];
+        long long child = tree.firstChild(frame.index);
+        if (child < 0) {
+            for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+                const Point3D& point = tree.points[i];
+                float dx = point.x - sx;
+                float dy = point.y - sy;
+                float dz = point.z - sz;
+                if (dx * dx + dy * dy + dz * dz <= sr * sr) result.push_back(&point);
+            }
+            continue;
+        }
+
+        // Дети кладутся в обратном порядке, чтобы обход шёл по возрастанию октантов
+        float half = frame.size / 2;
         float quarter = half / 2;
-        for (int i = 0; i < 8; ++i) {
+        for (int i = 7; i >= 0; --i) {
             float offsetX = (i & 1) ? quarter : -quarter;
             float offsetY = (i & 2) ? quarter : -quarter;
             float offsetZ = (i & 4) ? quarter : -quarter;
-            node->children[i] = new OctreeNode(node->x + offsetX, node->y + offsetY, node->z + offsetZ, half);
+            stack.push({ (size_t)child + i, frame.x + offsetX, frame.y + offsetY, frame.z + offsetZ, half });
         }
+    }
+}
 
-        // Перемещаем существующие точки в дочерние узлы
-        for (const auto& p : node->points) {
-            for (int i = 0; i < 8; ++i) {
-                insertPoint(node->children[i], p);
-            }
+// Компактный узел Octo-tree (32 байта). Хранятся только непустые дочерние узлы,
+// и все они лежат подряд начиная с firstChild: индекс ребёнка октанта i равен
+// firstChild плюс число установленных битов childMask ниже бита i
+struct CompactNode {
+    float x, y, z;        // Центр узла
+    float halfSize;       // Половина ребра, вычислена при построении
+    uint32_t firstChild;  // Индекс первого дочернего узла в CompactOctree::nodes
+    uint32_t first;       // Начало точек поддерева в CompactOctree::points
+    uint32_t count;       // Число точек поддерева
+    uint8_t childMask;    // Бит i установлен, если существует дочерний узел октанта i
+    uint8_t depth;        // Глубина узла
+    uint16_t reserved;
+};
+
+static_assert(sizeof(CompactNode) == 32, "CompactNode must stay 32 bytes");
+
+// Компактное Octo-tree: узлы в одном массиве, точки листов - в одном PointStore
+struct CompactOctree {
+    std::vector<CompactNode> nodes;
+    PointStore points;
+
+    // Возвращает индекс дочернего узла октанта i (узел должен существовать)
+    uint32_t child(const CompactNode& node, int i) const {
+        uint32_t below = node.childMask & ((1u << i) - 1);
+        uint32_t rank = 0;
+        for (; below; below &= below - 1) {
+            ++rank;
+        }
+        return node.firstChild + rank;
+    }
+};
+
+// Строит поддерево компактного узла index по отсортированному диапазону ключей [begin, end)
+void buildCompactRange(CompactOctree& tree, uint32_t index, const std::vector<Point3D>& points,
+    const std::vector<MortonEntry>& entries, size_t begin, size_t end, int level, const OctreeConfig& config) {
+    if (end - begin <= (size_t)config.maxPoints || level >= std::min(config.maxDepth, kMortonBitsPerAxis)) {
+        tree.nodes[index].first = (uint32_t)tree.points.size();
+        tree.nodes[index].count = (uint32_t)(end - begin);
+        for (size_t i = begin; i < end; ++i) {
+            const Point3D& p = points[entries[i].index];
+            tree.points.x.push_back(p.x);
+            tree.points.y.push_back(p.y);
+            tree.points.z.push_back(p.z);
         }
-        node->points.clear();
+        return;
+    }
+
+    int shift = 3 * (kMortonBitsPerAxis - 1 - level);
+    size_t bounds[9];
+    bounds[0] = begin;
+    uint8_t mask = 0;
+    for (int i = 0; i < 8; ++i) {
+        bounds[i + 1] = std::partition_point(entries.begin() + bounds[i], entries.begin() + end,
+            [&](const MortonEntry& e) { return (int)((e.key >> shift) & 7) <= i; }) - entries.begin();
+        if (bounds[i + 1] > bounds[i]) mask |= (uint8_t)(1u << i);
+    }
+
+    // Непустые дочерние узлы резервируются сразу, чтобы они легли подряд. Точки
+    // поддерева записываются подряд при обходе в глубину, поэтому их диапазон известен заранее
+    uint32_t firstChild = (uint32_t)tree.nodes.size();
+    CompactNode parent = tree.nodes[index];
+    parent.childMask = mask;
+    parent.firstChild = firstChild;
+    parent.first = (uint32_t)tree.points.size();
+    parent.count = (uint32_t)(end - begin);
+    tree.nodes[index] = parent;
+
+    float quarter = parent.halfSize / 2;
+    for (int i = 0; i < 8; ++i) {
+        if (!(mask & (1u << i))) continue;
+        CompactNode child = {};
+        child.x = parent.x + ((i & 1) ? quarter : -quarter);
+        child.y = parent.y + ((i & 2) ? quarter : -quarter);
+        child.z = parent.z + ((i & 4) ? quarter : -quarter);
+        child.halfSize = quarter;
+        child.depth = (uint8_t)(level + 1);
+        tree.nodes.push_back(child);
     }
 
-    // Вставляем новую точку в соответствующий дочерний узел
+    uint32_t next = firstChild;
     for (int i = 0; i < 8; ++i) {
-        insertPoint(node->children[i], point);
+        if (!(mask & (1u << i))) continue;
+        buildCompactRange(tree, next++, points, entries, bounds[i], bounds[i + 1], level + 1, config);
     }
 }
 
-// Функция для поиска точек внутри сферы
-void findPointsInSphere(OctreeNode* node, float sx, float sy, float sz, float sr, std::vector<Point3D*>& result) {
-    if (!node || !node->intersectsSphere(sx, sy, sz, sr)) return;
+// Функция для построения компактного Octo-tree. Непустые листы и их точки
+// совпадают с деревом buildOctreeMorton с теми же параметрами
+CompactOctree buildCompactOctree(const std::vector<Point3D>& points, float x, float y, float z, float size,
+    const OctreeConfig& config = OctreeConfig()) {
+    CompactOctree tree;
+
+    std::vector<MortonEntry> entries;
+    entries.reserve(points.size());
+    for (size_t i = 0; i < points.size(); ++i) {
+        const Point3D& p = points[i];
+        if (std::abs(p.x - x) > size / 2 || std::abs(p.y - y) > size / 2 || std::abs(p.z - z) > size / 2) continue;
+        entries.push_back({ mortonKey(p, x, y, z, size), (uint32_t)i });
+    }
+    radixSortMorton(entries);
+
+    CompactNode root = {};
+    root.x = x;
+    root.y = y;
+    root.z = z;
+    root.halfSize = size / 2;
+    tree.nodes.push_back(root);
+    buildCompactRange(tree, 0, points, entries, 0, entries.size(), 0, config);
+    return tree;
+}
 
-    // Проверяем точки, находящиеся в текущем узле
-    for (auto& point : node->points) {
-        float dx = point.x - sx;
-        float dy = point.y - sy;
-        float dz = point.z - sz;
-        if (dx * dx + dy * dy + dz * dz <= sr * sr) {
-            point.isInsideSphere = true;
-            result.push_back(&point);
+// Функция для поиска точек внутри сферы в компактном Octo-tree; в result добавляются индексы точек
+void findPointsInSphere(const CompactOctree& tree, float sx, float sy, float sz, float sr, std::vector<uint32_t>& result) {
+    if (tree.nodes.empty()) return;
+
+    SphereLeafKernel kernel = sphereLeafKernel();
+    TraversalStack<uint32_t> stack;
+    stack.push(0);
+    while (!stack.empty()) {
+        const CompactNode& node = tree.nodes[stack.pop()];
+        float h = node.halfSize;
+        if (!boxIntersectsSphere(node.x, node.y, node.z, h, h, h, sx, sy, sz, sr)) continue;
+        if (boxInsideSphere(node.x, node.y, node.z, h, h, h, sx, sy, sz, sr)) {
+            appendPointRange(node.first, node.count, result);
+            continue;
         }
-        else {
-            point.isInsideSphere = false;
+        if (node.childMask == 0) {
+            scanLeafInSphere(kernel, tree.points, node.first, node.count, sx, sy, sz, sr, result);
+            continue;
+        }
+
+        uint32_t child = node.firstChild;
+        for (uint32_t mask = node.childMask; mask; mask &= mask - 1) {
+            stack.push(child++);
         }
     }
+}
 
-    // Рекурсивно проверяем дочерние узлы
-    for (int i = 0; i < 8; ++i) {
-        findPointsInSphere(node->children[i], sx, sy, sz, sr, result);
+// Функция для поиска точек внутри параллелепипеда [min, max] в компактном Octo-tree;
+// в result добавляются индексы точек
+void findPointsInBox(const CompactOctree& tree, float minX, float minY, float minZ, float maxX, float maxY, float maxZ,
+    std::vector<uint32_t>& result) {
+    if (tree.nodes.empty()) return;
+
+    TraversalStack<uint32_t> stack;
+    stack.push(0);
+    while (!stack.empty()) {
+        const CompactNode& node = tree.nodes[stack.pop()];
+        float h = node.halfSize;
+        if (node.x - h > maxX || node.x + h < minX || node.y - h > maxY || node.y + h < minY ||
+            node.z - h > maxZ || node.z + h < minZ) {
+            continue;
+        }
+        if (node.x - h >= minX && node.x + h <= maxX && node.y - h >= minY && node.y + h <= maxY &&
+            node.z - h >= minZ && node.z + h <= maxZ) {
+            appendPointRange(node.first, node.count, result);
+            continue;
+        }
+        if (node.childMask == 0) {
+            scanLeafInBox(tree.points, node.first, node.count, minX, minY, minZ, maxX, maxY, maxZ, result);
+            continue;
+        }
+
+        uint32_t child = node.firstChild;
+        for (uint32_t mask = node.childMask; mask; mask &= mask - 1) {
+            stack.push(child++);
+        }
+    }
+}
+
+// Способ квантования координат точек относительно минимального угла листа
+enum class QuantizationMode {
+    Bits16,        // По 16 бит на ось (6 байт на точку)
+    Packed11_11_10 // 11 бит x, 11 бит y, 10 бит z в одном 32-битном слове (4 байта на точку)
+};
+
+// Сжатые координаты точек компактного Octo-tree. Индексы точек совпадают с
+// индексами в CompactOctree::points, которые после квантования можно освободить
+struct QuantizedCloud {
+    QuantizationMode mode = QuantizationMode::Bits16;
+    std::vector<uint16_t> x, y, z;  // Для Bits16
+    std::vector<uint32_t> packed;   // Для Packed11_11_10
+    float maxError = 0;             // Гарантированная максимальная ошибка по каждой оси
+};
+
+// Число бит на ось x, y, z для режима квантования
+void quantizationBits(QuantizationMode mode, int bits[3]) {
+    bits[0] = (mode == QuantizationMode::Bits16) ? 16 : 11;
+    bits[1] = (mode == QuantizationMode::Bits16) ? 16 : 11;
+    bits[2] = (mode == QuantizationMode::Bits16) ? 16 : 10;
+}
+
+// Функция для квантования точек компактного Octo-tree. Каждая координата хранится
+// как смещение от минимального угла листа с шагом ребро / (2^bits - 1), поэтому
+// ошибка по оси не превышает половины шага самого большого листа
+QuantizedCloud quantizePoints(const CompactOctree& tree, QuantizationMode mode) {
+    QuantizedCloud cloud;
+    cloud.mode = mode;
+    size_t count = tree.points.size();
+    if (mode == QuantizationMode::Bits16) {
+        cloud.x.resize(count);
+        cloud.y.resize(count);
+        cloud.z.resize(count);
+    }
+    else {
+        cloud.packed.resize(count);
+    }
+
+    int bits[3];
+    quantizationBits(mode, bits);
+    for (const auto& node : tree.nodes) {
+        if (node.childMask != 0 || node.count == 0) continue;
+        float edge = 2 * node.halfSize;
+        float minCorner[3] = { node.x - node.halfSize, node.y - node.halfSize, node.z - node.halfSize };
+        const std::vector<float>* coords[3] = { &tree.points.x, &tree.points.y, &tree.points.z };
+        for (int axis = 0; axis < 3; ++axis) {
+            float steps = (float)((1u << bits[axis]) - 1);
+            // Половина шага плюс запас на округление float при кодировании и декодировании
+            cloud.maxError = std::max(cloud.maxError, edge / steps / 2 + edge * 1e-6f);
+            for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+                float t = ((*coords[axis])[i] - minCorner[axis]) / edge * steps;
+                uint32_t q = (uint32_t)std::lround(std::max(0.0f, std::min(t, steps)));
+                if (mode == QuantizationMode::Bits16) {
+                    std::vector<uint16_t>& out = (axis == 0) ? cloud.x : (axis == 1) ? cloud.y : cloud.z;
+                    out[i] = (uint16_t)q;
+                }
+                else {
+                    cloud.packed[i] |= q << (axis == 0 ? 0 : axis == 1 ? 11 : 22);
+                }
+            }
+        }
+    }
+    return cloud;
+}
+
+// Восстанавливает координаты точки i листа leaf из сжатого представления
+Point3D decodeQuantizedPoint(const CompactNode& leaf, const QuantizedCloud& cloud, uint32_t i) {
+    int bits[3];
+    quantizationBits(cloud.mode, bits);
+    uint32_t q[3];
+    if (cloud.mode == QuantizationMode::Bits16) {
+        q[0] = cloud.x[i];
+        q[1] = cloud.y[i];
+        q[2] = cloud.z[i];
+    }
+    else {
+        q[0] = cloud.packed[i] & 0x7ff;
+        q[1] = (cloud.packed[i] >> 11) & 0x7ff;
+        q[2] = cloud.packed[i] >> 22;
+    }
+    float edge = 2 * leaf.halfSize;
+    return Point3D(leaf.x - leaf.halfSize + q[0] * edge / ((1u << bits[0]) - 1),
+        leaf.y - leaf.halfSize + q[1] * edge / ((1u << bits[1]) - 1),
+        leaf.z - leaf.halfSize + q[2] * edge / ((1u << bits[2]) - 1));
+}
+
+// Функция для поиска точек внутри сферы по сжатым координатам. Проверяются
+// восстановленные позиции, которые отличаются от исходных не больше cloud.maxError по оси
+void findPointsInSphere(const CompactOctree& tree, const QuantizedCloud& cloud, float sx, float sy, float sz, float sr,
+    std::vector<uint32_t>& result) {
+    if (tree.nodes.empty()) return;
+
+    TraversalStack<uint32_t> stack;
+    stack.push(0);
+    while (!stack.empty()) {
+        const CompactNode& node = tree.nodes[stack.pop()];
+        float h = node.halfSize;
+        if (!boxIntersectsSphere(node.x, node.y, node.z, h, h, h, sx, sy, sz, sr)) continue;
+
+        // Восстановленные точки не выходят за куб своего листа, поэтому поддерево
+        // целиком внутри сферы принимается без декодирования
+        if (boxInsideSphere(node.x, node.y, node.z, h, h, h, sx, sy, sz, sr)) {
+            appendPointRange(node.first, node.count, result);
+            continue;
+        }
+        if (node.childMask != 0) {
+            uint32_t child = node.firstChild;
+            for (uint32_t mask = node.childMask; mask; mask &= mask - 1) {
+                stack.push(child++);
+            }
+            continue;
+        }
+
+        for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+            Point3D p = decodeQuantizedPoint(node, cloud, i);
+            float dx = p.x - sx;
+            float dy = p.y - sy;
+            float dz = p.z - sz;
+            if (dx * dx + dy * dy + dz * dz <= sr * sr) result.push_back(i);
+        }
+    }
+}
+
+// Функция для подсчёта памяти линейного Octo-tree. Глубина узла определяется
+// по длине его кода (по 3 бита на уровень после бита-маркера)
+OctreeMemoryStats memoryStats(const LinearOctree& tree) {
+    OctreeMemoryStats stats;
+    for (const auto& node : tree.nodes) {
+        int depth = 0;
+        for (uint64_t code = node.code; code > 1; code >>= 3) {
+            ++depth;
+        }
+        bool leaf = node.count != kLinearInternalNode;
+        stats.addNode(depth, leaf, leaf ? node.count : 0);
+    }
+    stats.addVector(tree.nodes, stats.nodeBytes);
+    stats.addVector(tree.points, stats.pointBytes);
+    return stats;
+}
+
+// Функция для подсчёта памяти компактного Octo-tree. Если точки квантованы,
+// можно передать cloud, чтобы учесть и сжатые координаты
+OctreeMemoryStats memoryStats(const CompactOctree& tree, const QuantizedCloud* cloud = nullptr) {
+    OctreeMemoryStats stats;
+    for (const auto& node : tree.nodes) {
+        bool leaf = node.childMask == 0;
+        stats.addNode(node.depth, leaf, leaf ? node.count : 0);
+    }
+    stats.addVector(tree.nodes, stats.nodeBytes);
+    addStoreStats(tree.points, stats);
+    if (cloud) {
+        stats.addVector(cloud->x, stats.pointBytes);
+        stats.addVector(cloud->y, stats.pointBytes);
+        stats.addVector(cloud->z, stats.pointBytes);
+        stats.addVector(cloud->packed, stats.pointBytes);
+    }
+    return stats;
+}
+
+// Форма объекта в свободном Octo-tree
+enum class LooseShape {
+    Box,    // Параллелепипед с половинами размеров (hx, hy, hz)
+    Sphere  // Сфера радиуса hx
+};
+
+// Объект с протяжённостью: центр, половины размеров по осям и идентификатор
+struct LooseObject {
+    float x, y, z;
+    float hx, hy, hz;
+    uint32_t id;
+    LooseShape shape;
+
+    // Проверяет пересечение объекта со сферой
+    bool intersectsSphere(float sx, float sy, float sz, float sr) const {
+        if (shape == LooseShape::Box) return boxIntersectsSphere(x, y, z, hx, hy, hz, sx, sy, sz, sr);
+        float dx = x - sx, dy = y - sy, dz = z - sz;
+        return dx * dx + dy * dy + dz * dz <= (sr + hx) * (sr + hx);
+    }
+
+    // Проверяет пересечение объекта с параллелепипедом [min, max]
+    bool intersectsBox(float minX, float minY, float minZ, float maxX, float maxY, float maxZ) const {
+        if (shape == LooseShape::Sphere) {
+            return boxIntersectsSphere((minX + maxX) / 2, (minY + maxY) / 2, (minZ + maxZ) / 2,
+                (maxX - minX) / 2, (maxY - minY) / 2, (maxZ - minZ) / 2, x, y, z, hx);
+        }
+        return x - hx <= maxX && x + hx >= minX && y - hy <= maxY && y + hy >= minY && z - hz <= maxZ && z + hz >= minZ;
+    }
+};
+
+// Узел свободного (loose) Octo-tree. Ячейка узла такая же, как в обычном дереве,
+// но его границы увеличены в looseness раз относительно центра, поэтому объект
+// хранится в одном узле по своему центру, даже если пересекает плоскости деления
+struct LooseNode {
+    float x, y, z;          // Центр ячейки
+    float size;             // Размер ячейки (без увеличения)
+    std::vector<LooseObject> objects;
+    LooseNode* children[8]; // Дочерние узлы создаются по мере надобности
+    LooseNode* parent;
+
+    LooseNode(float x, float y, float z, float size, LooseNode* parent) : x(x), y(y), z(z), size(size), parent(parent) {
+        for (int i = 0; i < 8; ++i) {
+            children[i] = nullptr;
+        }
+    }
+};
+
+// Свободное Octo-tree для объектов с протяжённостью
+struct LooseOctree {
+    LooseNode* root;
+    float looseness;                 // Во сколько раз границы узла больше его ячейки (k)
+    int maxDepth;
+    std::vector<LooseNode*> nodeOf;  // Таблица "id объекта -> узел"
+
+    LooseOctree(float x, float y, float z, float size, float looseness = 2.0f, int maxDepth = 16)
+        : root(new LooseNode(x, y, z, size, nullptr)), looseness(looseness), maxDepth(maxDepth) {}
+
+    ~LooseOctree() { deleteNode(root); }
+
+    LooseOctree(const LooseOctree&) = delete;
+    LooseOctree& operator=(const LooseOctree&) = delete;
+
+    // Глубина, на которой хранится объект: самая глубокая, где увеличенные границы
+    // узла гарантированно вмещают объект с центром в ячейке узла. Вычисляется
+    // сразу, без проверок на каждом уровне
+    int depthFor(const LooseObject& object) const {
+        float extent = std::max(object.hx, std::max(object.hy, object.hz));
+        if (extent <= 0) return maxDepth;
+        float depth = std::floor(std::log2((looseness - 1) * root->size / (2 * extent)));
+        if (!(depth > 0)) return 0;
+        return std::min((int)depth, maxDepth);
+    }
+
+private:
+    static void deleteNode(LooseNode* node) {
+        if (!node) return;
+        for (int i = 0; i < 8; ++i) {
+            deleteNode(node->children[i]);
+        }
+        delete node;
+    }
+};
+
+// Функция для вставки объекта в свободное Octo-tree. Объект кладётся в единственный
+// узел на глубине depthFor по его центру. Объекты с центром вне корня и объекты с id,
+// который уже есть в дереве, не вставляются (для замены объекта есть updateObject)
+bool insertObject(LooseOctree& tree, const LooseObject& object) {
+    if (object.id < tree.nodeOf.size() && tree.nodeOf[object.id]) return false;
+
+    LooseNode* node = tree.root;
+    float half = node->size / 2;
+    if (std::abs(object.x - node->x) > half || std::abs(object.y - node->y) > half || std::abs(object.z - node->z) > half) {
+        return false;
+    }
+
+    for (int depth = tree.depthFor(object); depth > 0; --depth) {
+        int i = (object.x >= node->x ? 1 : 0) | (object.y >= node->y ? 2 : 0) | (object.z >= node->z ? 4 : 0);
+        if (!node->children[i]) {
+            float quarter = node->size / 4;
+            node->children[i] = new LooseNode(node->x + ((i & 1) ? quarter : -quarter), node->y + ((i & 2) ? quarter : -quarter),
+                node->z + ((i & 4) ? quarter : -quarter), node->size / 2, node);
+        }
+        node = node->children[i];
+    }
+
+    node->objects.push_back(object);
+    if (object.id >= tree.nodeOf.size()) tree.nodeOf.resize(object.id + 1, nullptr);
+    tree.nodeOf[object.id] = node;
+    return true;
+}
+
+// Функция для удаления объекта по id. Опустевшие узлы без детей удаляются
+bool removeObject(LooseOctree& tree, uint32_t id) {
+    if (id >= tree.nodeOf.size() || !tree.nodeOf[id]) return false;
+    LooseNode* node = tree.nodeOf[id];
+    for (size_t i = 0; i < node->objects.size(); ++i) {
+        if (node->objects[i].id != id) continue;
+        node->objects[i] = node->objects.back();
+        node->objects.pop_back();
+        tree.nodeOf[id] = nullptr;
+
+        while (node->parent && node->objects.empty() &&
+            std::find_if(node->children, node->children + 8, [](LooseNode* c) { return c != nullptr; }) == node->children + 8) {
+            LooseNode* parent = node->parent;
+            *std::find(parent->children, parent->children + 8, node) = nullptr;
+            delete node;
+            node = parent;
+        }
+        return true;
+    }
+    return false;
+}
+
+// Функция для обновления положения и размеров объекта. Если объект остаётся
+// в ячейке своего узла и на той же глубине, он обновляется на месте за O(1)
+bool updateObject(LooseOctree& tree, const LooseObject& object) {
+    if (object.id >= tree.nodeOf.size() || !tree.nodeOf[object.id]) return insertObject(tree, object);
+    LooseNode* node = tree.nodeOf[object.id];
+
+    int depth = 0;
+    for (LooseNode* n = node; n->parent; n = n->parent) {
+        ++depth;
+    }
+    float half = node->size / 2;
+    bool sameCell = object.x >= node->x - half && object.x < node->x + half &&
+        object.y >= node->y - half && object.y < node->y + half &&
+        object.z >= node->z - half && object.z < node->z + half;
+    if (sameCell && depth == tree.depthFor(object)) {
+        for (auto& o : node->objects) {
+            if (o.id == object.id) {
+                o = object;
+                return true;
+            }
+        }
+    }
+
+    removeObject(tree, object.id);
+    return insertObject(tree, object);
+}
+
+// Функция для поиска объектов свободного Octo-tree, пересекающих сферу; в result добавляются id.
+// Корень по увеличенным границам не отсекается: в нём остаются объекты, которые не помещаются в k * size
+void findObjectsInSphere(const LooseOctree& tree, float sx, float sy, float sz, float sr, std::vector<uint32_t>& result) {
+    TraversalStack<const LooseNode*> stack;
+    stack.push(tree.root);
+    while (!stack.empty()) {
+        const LooseNode* node = stack.pop();
+        if (node->parent && !cubeIntersectsSphere(node->x, node->y, node->z, node->size * tree.looseness, sx, sy, sz, sr)) {
+            continue;
+        }
+        for (const auto& object : node->objects) {
+            if (object.intersectsSphere(sx, sy, sz, sr)) result.push_back(object.id);
+        }
+        for (int i = 7; i >= 0; --i) {
+            if (node->children[i]) stack.push(node->children[i]);
+        }
+    }
+}
+
+// Функция для поиска объектов свободного Octo-tree, пересекающих параллелепипед [min, max];
+// в result добавляются id. Корень, как и в поиске по сфере, по увеличенным границам не отсекается
+void findObjectsInBox(const LooseOctree& tree, float minX, float minY, float minZ, float maxX, float maxY, float maxZ,
+    std::vector<uint32_t>& result) {
+    TraversalStack<const LooseNode*> stack;
+    stack.push(tree.root);
+    while (!stack.empty()) {
+        const LooseNode* node = stack.pop();
+        float half = node->size * tree.looseness / 2;
+        if (node->parent && (node->x - half > maxX || node->x + half < minX || node->y - half > maxY ||
+            node->y + half < minY || node->z - half > maxZ || node->z + half < minZ)) {
+            continue;
+        }
+        for (const auto& object : node->objects) {
+            if (object.intersectsBox(minX, minY, minZ, maxX, maxY, maxZ)) result.push_back(object.id);
+        }
+        for (int i = 7; i >= 0; --i) {
+            if (node->children[i]) stack.push(node->children[i]);
+        }
     }
 }
 
+// Свойства обобщённого Octo-tree по умолчанию: координаты берутся из полей x, y, z
+// пользовательской структуры, квадраты расстояний для целых координат считаются
+// в long long, а целочисленный узел перестаёт делиться на ребре 1
+template <class Payload, class Scalar>
+struct OctreeTraits {
+    using Distance = typename std::conditional<std::is_integral<Scalar>::value, long long, Scalar>::type;
+
+    static Scalar x(const Payload& item) { return (Scalar)item.x; }
+    static Scalar y(const Payload& item) { return (Scalar)item.y; }
+    static Scalar z(const Payload& item) { return (Scalar)item.z; }
+
+    static bool canSplit(Scalar size) { return std::is_integral<Scalar>::value ? size > 1 : size > 0; }
+};
+
+// Геометрия полуоткрытых ячеек [min, min + size), общая для Octree и FixedOctree:
+// принадлежность точки, выбор и размещение дочерних ячеек и расстояния. Node -
+// любой узел с полями minX, minY, minZ и size; координаты элементов читаются через Traits
+template <class Scalar, class Traits>
+struct OctreeCells {
+    using Distance = typename Traits::Distance;
+
+    template <class Node>
+    static bool contains(const Node& node, Scalar px, Scalar py, Scalar pz) {
+        return px >= node.minX && px - node.minX < node.size &&
+            py >= node.minY && py - node.minY < node.size &&
+            pz >= node.minZ && pz - node.minZ < node.size;
+    }
+
+    template <class Node>
+    static int childIndex(const Node& node, Scalar px, Scalar py, Scalar pz) {
+        Scalar half = node.size / 2;
+        return (px - node.minX >= half ? 1 : 0) | (py - node.minY >= half ? 2 : 0) | (pz - node.minZ >= half ? 4 : 0);
+    }
+
+    // Задаёт углы и размеры 8 дочерних ячеек узла
+    template <class Node>
+    static void placeChildren(const Node& node, Node* children) {
+        Scalar half = node.size / 2;
+        for (int i = 0; i < 8; ++i) {
+            Node& child = children[i];
+            child.minX = node.minX + ((i & 1) ? half : 0);
+            child.minY = node.minY + ((i & 2) ? half : 0);
+            child.minZ = node.minZ + ((i & 4) ? half : 0);
+            child.size = half;
+        }
+    }
+
+    // Квадрат расстояния от точки до ячейки узла
+    template <class Node>
+    static Distance distanceSquared(const Node& node, Scalar sx, Scalar sy, Scalar sz) {
+        auto axis = [](Scalar s, Scalar lo, Scalar size) {
+            Distance d = 0;
+            if (s < lo) d = (Distance)lo - (Distance)s;
+            else if (s - lo > size) d = (Distance)s - (Distance)lo - (Distance)size;
+            return d * d;
+        };
+        return axis(sx, node.minX, node.size) + axis(sy, node.minY, node.size) + axis(sz, node.minZ, node.size);
+    }
+
+    // Квадрат расстояния от элемента до точки
+    template <class Item>
+    static Distance itemDistanceSquared(const Item& item, Scalar sx, Scalar sy, Scalar sz) {
+        Distance dx = (Distance)Traits::x(item) - (Distance)sx;
+        Distance dy = (Distance)Traits::y(item) - (Distance)sy;
+        Distance dz = (Distance)Traits::z(item) - (Distance)sz;
+        return dx * dx + dy * dy + dz * dz;
+    }
+};
+
+// Обобщённое Octo-tree, хранящее пользовательские структуры Payload напрямую,
+// без копирования в Point3D. Координаты имеют тип Scalar (float, double или целые)
+// и читаются через Traits. Ячейки узлов полуоткрыты: [min, min + size)
+template <class Payload, class Scalar = float, class Traits = OctreeTraits<Payload, Scalar>>
+class Octree {
+    using Cells = OctreeCells<Scalar, Traits>;
+
+public:
+    using Distance = typename Traits::Distance;
+
+    struct Node {
+        Scalar minX = 0, minY = 0, minZ = 0; // Минимальный угол ячейки
+        Scalar size = 0;                     // Ребро ячейки
+        std::vector<Payload> items;          // Элементы листа
+        std::unique_ptr<Node[]> children;    // 8 дочерних узлов подряд (nullptr у листа)
+    };
+
+    // Для целых координат ребро корня округляется вверх до степени двойки,
+    // чтобы ячейки делились пополам без остатка
+    Octree(Scalar minX, Scalar minY, Scalar minZ, Scalar size, int maxPoints = 4, int maxDepth = 21)
+        : maxPoints(maxPoints), maxDepth(maxDepth) {
+        root.minX = minX;
+        root.minY = minY;
+        root.minZ = minZ;
+        root.size = size;
+        if (std::is_integral<Scalar>::value) {
+            root.size = 1;
+            while (root.size < size) {
+                root.size *= 2;
+            }
+        }
+    }
+
+    const Node& rootNode() const { return root; }
+    size_t size() const { return itemCount; }
+
+    // Вставляет элемент; элементы вне корня отбрасываются
+    bool insert(const Payload& item) {
+        Scalar px = Traits::x(item), py = Traits::y(item), pz = Traits::z(item);
+        if (!Cells::contains(root, px, py, pz)) return false;
+
+        Node* node = &root;
+        int depth = 0;
+        while (true) {
+            if (!node->children) {
+                if ((int)node->items.size() < maxPoints || depth >= maxDepth || !Traits::canSplit(node->size)) {
+                    node->items.push_back(item);
+                    ++itemCount;
+                    return true;
+                }
+                split(*node);
+            }
+            node = &node->children[Cells::childIndex(*node, px, py, pz)];
+            ++depth;
+        }
+    }
+
+    // Вставляет диапазон элементов [first, last)
+    template <class InputIt>
+    void insert(InputIt first, InputIt last) {
+        for (; first != last; ++first) {
+            insert(*first);
+        }
+    }
+
+    // Вызывает visit(const Payload&) для каждого элемента внутри сферы. Дерево не изменяется
+    template <class Visitor>
+    void findInSphere(Scalar sx, Scalar sy, Scalar sz, Scalar sr, Visitor visit) const {
+        Distance radiusSquared = (Distance)sr * (Distance)sr;
+        TraversalStack<const Node*> stack;
+        stack.push(&root);
+        while (!stack.empty()) {
+            const Node& node = *stack.pop();
+            if (Cells::distanceSquared(node, sx, sy, sz) > radiusSquared) continue;
+            for (const auto& item : node.items) {
+                if (Cells::itemDistanceSquared(item, sx, sy, sz) <= radiusSquared) visit(item);
+            }
+            if (!node.children) continue;
+            for (int i = 7; i >= 0; --i) {
+                stack.push(&node.children[i]);
+            }
+        }
+    }
+
+    // Добавляет в result указатели на элементы внутри сферы
+    void findInSphere(Scalar sx, Scalar sy, Scalar sz, Scalar sr, std::vector<const Payload*>& result) const {
+        findInSphere(sx, sy, sz, sr, [&](const Payload& item) { result.push_back(&item); });
+    }
+
+    void clear() {
+        root.items.clear();
+        root.children.reset();
+        itemCount = 0;
+    }
+
+private:
+    static void split(Node& node) {
+        node.children.reset(new Node[8]);
+        Cells::placeChildren(node, node.children.get());
+        for (const auto& item : node.items) {
+            node.children[Cells::childIndex(node, Traits::x(item), Traits::y(item), Traits::z(item))].items.push_back(item);
+        }
+        std::vector<Payload>().swap(node.items);
+    }
+
+    Node root;
+    int maxPoints;
+    int maxDepth;
+    size_t itemCount = 0;
+};
+
+// Octo-tree с вместимостью листа MaxPoints и глубиной MaxDepth, известными при
+// компиляции. Элементы листа лежат во встроенном массиве узла (без отдельного
+// выделения памяти), стек обхода имеет фиксированный размер, а цикл проверки
+// расстояний в листе имеет постоянную длину и полностью разворачивается
+// компилятором. Payload должен иметь конструктор по умолчанию. Листы на глубине
+// MaxDepth при переполнении переносят лишние элементы в дополнительный вектор.
+// Для вместимости, известной только во время работы, остаётся Octree
+template <class Payload, class Scalar, int MaxPoints, int MaxDepth, class Traits = OctreeTraits<Payload, Scalar>>
+class FixedOctree {
+    static_assert(MaxPoints > 0, "MaxPoints must be positive");
+    static_assert(MaxDepth > 0 && MaxDepth <= 64, "MaxDepth must be in [1, 64]");
+    using Cells = OctreeCells<Scalar, Traits>;
+
+public:
+    using Distance = typename Traits::Distance;
+
+    struct Node {
+        Scalar minX = 0, minY = 0, minZ = 0; // Минимальный угол ячейки
+        Scalar size = 0;                     // Ребро ячейки
+        int count = 0;                       // Число элементов во встроенном массиве
+        Payload items[MaxPoints]{};          // Значения по умолчанию: цикл запроса читает и пустые ячейки
+        std::unique_ptr<Node[]> children;    // 8 дочерних узлов подряд (nullptr у листа)
+        std::unique_ptr<std::vector<Payload>> overflow; // Переполнение листа на глубине MaxDepth
+    };
+
+    FixedOctree(Scalar minX, Scalar minY, Scalar minZ, Scalar size) {
+        root.minX = minX;
+        root.minY = minY;
+        root.minZ = minZ;
+        root.size = size;
+    }
+
+    size_t size() const { return itemCount; }
+
+    // Вставляет элемент; элементы вне корня отбрасываются
+    bool insert(const Payload& item) {
+        Scalar px = Traits::x(item), py = Traits::y(item), pz = Traits::z(item);
+        if (!Cells::contains(root, px, py, pz)) return false;
+
+        Node* node = &root;
+        for (int depth = 0;; ++depth) {
+            if (!node->children) {
+                if (node->count < MaxPoints) {
+                    node->items[node->count++] = item;
+                    break;
+                }
+                if (depth == MaxDepth || !Traits::canSplit(node->size)) {
+                    if (!node->overflow) node->overflow.reset(new std::vector<Payload>());
+                    node->overflow->push_back(item);
+                    break;
+                }
+                split(*node);
+            }
+            node = &node->children[Cells::childIndex(*node, px, py, pz)];
+        }
+        ++itemCount;
+        return true;
+    }
+
+    // Вызывает visit(const Payload&) для каждого элемента внутри сферы. Дерево не изменяется
+    template <class Visitor>
+    void findInSphere(Scalar sx, Scalar sy, Scalar sz, Scalar sr, Visitor visit) const {
+        Distance radiusSquared = (Distance)sr * (Distance)sr;
+
+        // При обходе в глубину на стеке не больше 7 узлов на уровень
+        const Node* stack[7 * MaxDepth + 8];
+        int top = 0;
+        stack[top++] = &root;
+        while (top > 0) {
+            const Node& node = *stack[--top];
+            if (Cells::distanceSquared(node, sx, sy, sz) > radiusSquared) continue;
+
+            if (node.children) {
+                for (int i = 0; i < 8; ++i) {
+                    stack[top++] = &node.children[i];
+                }
+                continue;
+            }
+
+            // Длина цикла известна при компиляции; пустые ячейки отсекаются условием i < count
+            for (int i = 0; i < MaxPoints; ++i) {
+                bool inside = Cells::itemDistanceSquared(node.items[i], sx, sy, sz) <= radiusSquared;
+                if ((i < node.count) & inside) visit(node.items[i]);
+            }
+            if (node.overflow) {
+                for (const auto& item : *node.overflow) {
+                    if (Cells::itemDistanceSquared(item, sx, sy, sz) <= radiusSquared) visit(item);
+                }
+            }
+        }
+    }
+
+    // Добавляет в result указатели на элементы внутри сферы
+    void findInSphere(Scalar sx, Scalar sy, Scalar sz, Scalar sr, std::vector<const Payload*>& result) const {
+        findInSphere(sx, sy, sz, sr, [&](const Payload& item) { result.push_back(&item); });
+    }
+
+private:
+    static void split(Node& node) {
+        node.children.reset(new Node[8]);
+        Cells::placeChildren(node, node.children.get());
+        // Лист делится только полным, и MaxPoints элементов всегда помещаются в детей
+        for (int i = 0; i < node.count; ++i) {
+            const Payload& item = node.items[i];
+            Node& child = node.children[Cells::childIndex(node, Traits::x(item), Traits::y(item), Traits::z(item))];
+            child.items[child.count++] = item;
+        }
+        node.count = 0;
+    }
+
+    Node root;
+    size_t itemCount = 0;
+};
+
 // Функция для рисования куба в OpenGL
 void drawCube(float x, float y, float z, float size) {
     float half = size / 2;
@@ -180,33 +3366,68 @@ void drawSphere(float x, float y, float z, float radius, int slices, int stacks)
 void drawOctree(OctreeNode* node) {
     if (!node) return;
 
-    drawCube(node->x, node->y, node->z, node->size);
-
     glPointSize(5.0f); // Устанавливаем размер точек
-    for (const auto& point : node->points) {
-        glColor3f(point.isInsideSphere ? 1.0f : 0.0f, point.isInsideSphere ? 0.0f : 1.0f, 0.0f); // Красный для точек внутри сферы, синий для остальных
-        glBegin(GL_POINTS);
-        glVertex3f(point.x, point.y, point.z);
-        glEnd();
-    }
+    TraversalStack<OctreeNode*> stack;
+    stack.push(node);
+    while (!stack.empty()) {
+        node = stack.pop();
+        drawCube(node->x, node->y, node->z, node->size);
 
-    for (int i = 0; i < 8; ++i) {
-        drawOctree(node->children[i]);
+        for (const auto& point : node->points) {
+            glColor3f(point.isInsideSphere ? 1.0f : 0.0f, point.isInsideSphere ? 0.0f : 1.0f, 0.0f); // Красный для точек внутри сферы, синий для остальных
+            glBegin(GL_POINTS);
+            glVertex3f(point.x, point.y, point.z);
+            glEnd();
+        }
+
+        if (node->children[0] == nullptr) continue;
+        for (int i = 7; i >= 0; --i) {
+            prefetchNode(node->children[i]);
+            stack.push(node->children[i]);
+        }
     }
 }
 
-int main() {
+int main(int argc, char* argv[]) {
+    // Режим замера параллельного построения: Octo-tree --bench-build [число точек]
+    if (argc > 1 && std::string(argv[1]) == "--bench-build") {
+        size_t count = (argc > 2) ? std::stoul(argv[2]) : 10000000;
+        std::vector<Point3D> cloud;
+        cloud.reserve(count);
+        for (size_t i = 0; i < count; ++i) {
+            cloud.emplace_back(rand() * 200.0f / RAND_MAX - 100, rand() * 200.0f / RAND_MAX - 100, rand() * 200.0f / RAND_MAX - 100);
+        }
+        benchmarkParallelBuild(cloud, 0, 0, 0, 200, OctreeConfig(), std::max(1u, std::thread::hardware_concurrency()));
+        return 0;
+    }
+
+    // Режим подбора вместимости листа: Octo-tree --tune-leaf [число точек] [радиус запроса]
+    if (argc > 1 && std::string(argv[1]) == "--tune-leaf") {
+        size_t count = (argc > 2) ? std::stoul(argv[2]) : 1000000;
+        float radius = (argc > 3) ? std::stof(argv[3]) : 5.0f;
+        std::vector<Point3D> cloud;
+        cloud.reserve(count);
+        for (size_t i = 0; i < count; ++i) {
+            cloud.emplace_back(rand() * 200.0f / RAND_MAX - 100, rand() * 200.0f / RAND_MAX - 100, rand() * 200.0f / RAND_MAX - 100);
+        }
+        tuneLeafCapacity(cloud, 0, 0, 0, 200, radius);
+        return 0;
+    }
+
     // Генерация случайных точек
     std::vector<Point3D> points;
     for (int i = 0; i < 100; ++i) {
         points.emplace_back(rand() % 200 - 100, rand() % 200 - 100, rand() % 200 - 100);
     }
 
-    // Построение Octo-tree
-    OctreeNode* root = new OctreeNode(0, 0, 0, 200);
-    for (const auto& point : points) {
-        insertPoint(root, point);
-    }
+    // Построение Octo-tree; узлы живут в арене и освобождаются вместе с ней
+    OctreeArena arena;
+    OctreeConfig config;
+    config.arena = &arena;
+    OctreeNode* root = buildOctreeMorton(points, 0, 0, 0, 200, config);
+    std::cout << "Octree: " << arena.nodeCount() << " nodes, " << arena.bytesInUse() << " bytes in use, "
+        << arena.bytesReserved() << " bytes reserved\n";
+    printMemoryStats(memoryStats(root, nullptr, &arena));
 
     // Параметры сферы
     float sphereX = 0, sphereY = 0, sphereZ = 0, sphereRadius = 50;